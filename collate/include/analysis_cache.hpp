@@ -0,0 +1,47 @@
+#ifndef COLLATE_ANALYSIS_CACHE_HPP
+#define COLLATE_ANALYSIS_CACHE_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace COLLATE
+{
+    /*分析结果的磁盘缓存。
+      缓存文件以模块内容和影响结果的选项的哈希命名，命中时可以跳过全部分析。
+      文件中的Value都用ValueIndex的编号表示，同一模块上编号是确定的。
+    */
+    class AnalysisCache
+    {
+    public:
+        static const uint32_t Version = 6;
+
+        struct Contents
+        {
+            std::vector<std::string> sensitiveTypes;                 // 敏感的具名结构体
+            std::vector<std::pair<uint32_t, uint32_t>> directCalls;  // 调用点 -> 被调函数
+            std::vector<std::vector<uint32_t>> targetSets;           // 去重后的间接调用目标集合
+            std::vector<std::pair<uint32_t, uint32_t>> indirectCalls; // 被调用的操作数 -> 目标集合下标
+            std::vector<uint32_t> controlRelatedData;
+            std::vector<uint32_t> memOfCrData;
+            std::vector<uint32_t> memAccessors;                      // 可能访问memOfCrData的指令
+            std::vector<uint32_t> trustedInsts;                      // 未命中时插入开关的指令，-collate-verify用来检查命中
+        };
+
+        AnalysisCache(llvm::StringRef dir, llvm::Module &M, llvm::StringRef options);
+
+        // numValues是ValueIndex预先编号的值的个数，用于校验缓存是否属于同一份IR
+        bool load(Contents &C, uint32_t numValues);
+        bool store(const Contents &C, uint32_t numValues);
+
+        const std::string &getPath() const { return path; }
+
+    private:
+        std::string path;
+    };
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef COLLATE_ANALYSIS_STATS_HPP
+#define COLLATE_ANALYSIS_STATS_HPP
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace COLLATE
+{
+    /*分析各阶段的耗时和内存。
+      每个阶段对应TimerGroup中的一个Timer，-collate-stats时由TimerGroup按LLVM的格式打印；
+      同时记录阶段结束时的峰值RSS、各集合的大小以及污点传播每一轮的耗时，可以输出为JSON。
+    */
+    class AnalysisStats
+    {
+    public:
+        /*在作用域内为一个阶段计时*/
+        class Scope
+        {
+        public:
+            Scope(AnalysisStats &stats, llvm::StringRef name);
+            ~Scope();
+
+        private:
+            AnalysisStats &stats;
+            unsigned phase;
+        };
+
+        AnalysisStats();
+        ~AnalysisStats();
+
+        // 集合大小等计数，同名的计数以最后一次为准
+        void setCounter(llvm::StringRef name, uint64_t value);
+
+        // 污点传播的一轮：串行传播只有一轮，并行传播每个同步点一轮
+        void addRound(double wallSeconds, uint64_t instructions);
+
+        void print(llvm::raw_ostream &OS);
+        void writeJSON(llvm::raw_ostream &OS) const;
+
+        // 进程到目前为止的峰值RSS(字节)
+        static uint64_t getPeakRSS();
+
+    private:
+        struct Phase
+        {
+            std::unique_ptr<llvm::Timer> timer;
+            uint64_t peakRSS = 0;
+        };
+
+        llvm::TimerGroup group;
+        std::vector<Phase> phases;
+        std::vector<std::pair<std::string, uint64_t>> counters;
+        std::vector<std::pair<double, uint64_t>> rounds;
+    };
+}
+
+#endif
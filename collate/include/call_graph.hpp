@@ -0,0 +1,46 @@
+#ifndef COLLATE_CALL_GRAPH_HPP
+#define COLLATE_CALL_GRAPH_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <vector>
+#include <utility>
+
+namespace COLLATE
+{
+    /*被调函数 -> 调用点的反向调用图，以CSR形式存放：
+      函数按模块顺序编号，第i个函数的调用点是callSites[offsets[i], offsets[i+1])。
+      构建时先收集所有边，finalize时按被调函数做一次计数排序，
+      同一函数的调用点保持加入的顺序；之后只读，可以在并行传播中共享。
+    */
+    class ReverseCallGraph
+    {
+    public:
+        void init(llvm::Module &M);
+        void addEdge(llvm::Function *callee, llvm::CallBase *CB);
+        void finalize();
+
+        llvm::ArrayRef<llvm::CallBase *> getCallSites(const llvm::Function *F) const
+        {
+            auto it = funcIndex.find(F);
+            if (it == funcIndex.end() || offsets.empty())
+                return llvm::ArrayRef<llvm::CallBase *>();
+            return llvm::makeArrayRef(callSites).slice(offsets[it->second], offsets[it->second + 1] - offsets[it->second]);
+        }
+
+        unsigned getNumFunctions() const { return funcIndex.size(); }
+        unsigned getNumEdges() const { return callSites.size(); }
+
+    private:
+        llvm::DenseMap<const llvm::Function *, unsigned> funcIndex;
+        std::vector<std::pair<unsigned, llvm::CallBase *>> edges; // 只在构建期间使用
+        std::vector<uint32_t> offsets;
+        std::vector<llvm::CallBase *> callSites;
+    };
+}
+
+#endif
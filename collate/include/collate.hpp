@@ -12,10 +12,18 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LegacyPassManager.h"
 
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
 
@@ -24,6 +32,9 @@
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/CommandLine.h"
 
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/TargetFolder.h"
@@ -52,18 +63,142 @@
 
 #include "DDA/DDAClient.h"
 #include "DDA/ContextDDA.h"
+#include "WPA/Andersen.h"
+#include "WPA/FlowSensitive.h"
 #include "SVF-FE/LLVMUtil.h"
 #include "SVF-FE/SVFIRBuilder.h"
 #include "Util/SCC.h"
 #include "Util/Options.h"
 #include "MemoryModel/PointerAnalysisImpl.h"
 
+#include "taint_set.hpp"
+#include "call_graph.hpp"
+#include "func_model.hpp"
+#include "analysis_cache.hpp"
+#include "incremental_state.hpp"
+#include "dda_client.hpp"
+#include "svf_context.hpp"
+#include "svfg_taint.hpp"
+#include "report_writer.hpp"
+#include "manifest.hpp"
+#include "mpk_gate.hpp"
+#include "safe_heap.hpp"
+#include "safe_placement.hpp"
+#include "analysis_stats.hpp"
+
 using namespace std;
 using namespace SVF;
 using namespace llvm;
+using namespace COLLATE;
 
-namespace 
+namespace
 {
+    /*污点传播的工作队列。
+      新被污染的值进入值队列，传播时只重新检查这些值的使用者；
+      跨函数的事实(函数返回值敏感、va_list敏感)变化时，相关指令进入指令队列重新检查。
+      队列中保存的是ValueIndex的编号，传播中的成员判断和插入都直接操作位向量。
+      并行传播时，每个函数使用一个本地队列：共享的污点集合只读，新污点记录在本地增量中，
+      由主线程在同步点按函数顺序合并。本地增量的成员判断使用所在线程复用的位向量(见bindLocalBits)。
+    */
+    class TaintWorklist
+    {
+    public:
+        TaintWorklist(TaintSet &taintValues) : taintValues(&taintValues), base(&taintValues) {}
+        TaintWorklist(const TaintSet &base) : taintValues(nullptr), base(&base) {}
+
+        bool count(unsigned id) const
+        {
+            return base->test(id) || (!taintValues && id < localBits->size() && localBits->test(id));
+        }
+
+        bool insert(unsigned id)
+        {
+            if (taintValues)
+            {
+                if (!taintValues->set(id))
+                    return false;
+            }
+            else
+            {
+                if (base->test(id) || id >= localBits->size() || localBits->test(id))
+                    return false;
+                localBits->set(id);
+                delta.push_back(id);
+            }
+            pendingValues.push_back(id);
+            return true;
+        }
+
+        // 本地队列不能给值分配新编号(并行传播时编号只读)，只有预先编号的值会被污染
+        bool count(Value *V) const { return count(getIndex().lookup(V)); }
+        bool insert(Value *V) { return insert(taintValues ? getIndex().getID(V) : getIndex().lookup(V)); }
+
+        // 只加入集合，不触发对使用者的检查(调用者已经处理过)
+        bool insertQuiet(unsigned id)
+        {
+            assert(taintValues && "local worklists are read-only on the shared set");
+            return taintValues->set(id);
+        }
+        bool insertQuiet(Value *V) { return insertQuiet(getIndex().getID(V)); }
+
+        void revisit(unsigned id) { pendingInsts.push_back(id); }
+        void revisit(Instruction *I) { revisit(getIndex().lookup(I)); }
+
+        /*本地队列在开始传播前绑定所在线程的位向量，位向量的大小至少为编号的个数且全部清零；
+          解除绑定时只清除增量中的位，留给该线程的下一个函数使用*/
+        void bindLocalBits(BitVector *bits) { localBits = bits; }
+        void unbindLocalBits()
+        {
+            for (unsigned id : delta)
+                localBits->reset(id);
+            localBits = nullptr;
+        }
+
+        bool empty() const { return pendingValues.empty() && pendingInsts.empty(); }
+        bool hasPendingInst() const { return !pendingInsts.empty(); }
+
+        unsigned popValue()
+        {
+            unsigned id = pendingValues.back();
+            pendingValues.pop_back();
+            return id;
+        }
+
+        unsigned popInst()
+        {
+            unsigned id = pendingInsts.back();
+            pendingInsts.pop_back();
+            return id;
+        }
+
+        const TaintSet &getSet() const { return *base; }
+        ValueIndex &getIndex() const { return base->getIndex(); }
+        const vector<unsigned> &getDelta() const { return delta; }
+
+    private:
+        TaintSet *taintValues;
+        const TaintSet *base;
+        BitVector *localBits = nullptr;
+        vector<unsigned> delta;
+        vector<unsigned> pendingValues;
+        vector<unsigned> pendingInsts;
+    };
+
+    /*函数签名：返回值类型和各参数类型的规范化表示，长度隐含了参数个数*/
+    typedef SmallVector<uintptr_t, 8> CallSignature;
+
+    /*间接调用的目标集合。集合在analyzeIndirectCalls中构建后不再修改，
+      签名相同的调用点共享同一个集合*/
+    typedef vector<Function *> CallTargets;
+
+    struct CallSignatureHash
+    {
+        size_t operator()(const CallSignature &S) const
+        {
+            return hash_combine_range(S.begin(), S.end());
+        }
+    };
+
     class COLLATEPass : public ModulePass
     {
     public:
@@ -81,40 +216,92 @@ namespace
           加上数字后缀，如%struct.ngx_http_connection_t.1248。
         */
         void analyzeStructTypeEquality(Module &M);
+        size_t layoutHash(Type *Ty);
         bool isEqual(Type *a, Type *b);
-        bool isTypeMatch(CallBase *CB, Function *F, Type *ReturnType);
+        uintptr_t canonicalType(Type *Ty);
+        CallSignature getSignature(Function *F);
+        CallSignature getSignature(CallBase *CB);
         void analyzeIndirectCalls(Module &M);
 
         /*污点源是包含函数指针的内存对象*/
-        void identifyTaintSources(Module &M, unordered_set<Value *> &result);
-        bool shouldProtectType(Type *Ty, unordered_set<Type *> &Visited, vector<Type *> &Route, MDNode *TBAATag = NULL);
+        void identifyTaintSources(Module &M, TaintSet &result);
+        void identifyGlobalTaintSources(Module &M, TaintSet &result);
+        void identifyTaintSources(Function &F, TaintSet &result);
+        void collectReturnValues(Function &F);
+        void classifyTypes(Module &M);
+        void classifyTypeSCCs(Type *Root);
+        bool isSensitiveType(Type *Ty);
+        bool isSensitiveType(Type *Ty, MDNode *TBAATag);
+        bool isFuncPtrTag(MDNode *TBAATag);
+
+        void taintPropagation(Module &M, const TaintSet &source, TaintSet &taintedSet, TaintSet &result);
+        void propagateTaint(TaintWorklist &taintValues);
+        void sliceConstrainingData(const TaintSet &taintedSet, TaintSet &result);
+        void propagate(TaintWorklist &taintValues);
+        void propagateParallel(TaintWorklist &taintValues);
+        void propagateInFunction(ArrayRef<unsigned> insts, TaintWorklist &localValues);
+        bool isInterprocedural(Instruction *I);
+        /*以下规则的参数都是ValueIndex的编号：inst是指令，CS是调用点，F是被调函数*/
+        bool doInInstruction(unsigned inst, TaintWorklist &taintValues);
+        bool handleCallsite(unsigned CS, unsigned F, TaintWorklist &taintValues);
+        void handleCallsites(Function *F, TaintWorklist &taintValues); // F的所有调用点
+
+        DominatorTree &getDomTree(Function &F);
 
-        void taintPropagation(Module &M, unordered_set<Value *> source, unordered_set<Value *> &result);
-        bool doInFunction(Function &F, unordered_set<Value *> &taintValues);
-        bool handleCallsite(CallBase *CS, Function *F, unordered_set<Value *> &taintValues);
+        void dumpCrData(Module &M, TaintSet &content);
 
-        void dumpCrData(unordered_set<Value *> &content);
+        void runPointerAnalysis(Module &M, TaintSet &crData);
+        string getOptionsFingerprint();
 
-        void runPointerAnalysis(Module &M);
-        void getPointsToSet(Value *val, vector<Value*> &result);
+        void getMemOfCrData(TaintSet &values, TaintSet &mems);
+        void getAccessorsOfMems(Module &M, TaintSet &mems, TaintSet &accessors);
+        bool isMemCall(CallBase *CB);
 
-        void getMemOfCrData(unordered_set<Value *> &values, unordered_set<Value *> &mems);
+        /*在访问受保护内存的指令前后插入MPK的开关*/
+        void collectTrustedInstructions(TaintSet &crData, TaintSet &accessors, TaintSet &trusted);
+        void instrumentTrustedInstructions(Module &M, TaintSet &trusted);
 
-        void instrumentTrustedInstructions(Module &M, unordered_set<Value *> &protectedMems);
+        /*把受保护的全局变量和栈对象放进safe region*/
+        void placeSafeObjects(Module &M, TaintSet &protectedMems, ManifestEmitter &manifest);
+
+        /*分析结果的磁盘缓存*/
+        void saveCache(Module &M, AnalysisCache &cache, TaintSet &crData, TaintSet &mems, TaintSet &accessors,
+                       TaintSet &trusted);
+        bool loadCache(Module &M, AnalysisCache &cache, TaintSet &crData, TaintSet &mems, TaintSet &accessors,
+                       TaintSet &trusted);
+
+        /*以函数为粒度的增量分析：重新分析内容变化的函数以及污点可能经过它们到达的函数，
+          其余函数复用上一次运行保存的污点源和污点，结果与完整分析相同*/
+        void incrementalTaintAnalysis(Module &M, TaintSet &source, TaintSet &taintedSet, TaintSet &result);
+        void saveIncrementalState(Module &M, IncrementalState &state, const TaintSet &source, const TaintSet &taintedSet);
+        // -collate-verify：重新做一次完整分析，与增量分析的结果比较
+        void verifyIncremental(Module &M, const TaintSet &crData);
+        void collectCallees(Function &F, SmallSetVector<Function *, 8> &callees);
 
         COLLATEPass() : ModulePass(ID) {}
     private:
-        map<StructType *, int> typeID;
+        DenseMap<StructType *, unsigned> typeID; // 结构体 -> 等价类的编号
         DenseMap<Value *, Function *> directCall2Target;
-        DenseMap<Value *, unordered_set<Function *>> indirectCall2Target;
-        DenseMap<Type *, bool> taintSourceTypes;
+        DenseMap<Value *, const CallTargets *> indirectCall2Target;
+        unordered_map<CallSignature, CallTargets, CallSignatureHash> sig2Targets; // 签名 -> 被取地址的函数
+        unordered_map<Function *, CallTargets> singleTargets; // bitcast后被调用的函数 -> 只含它自己的目标集合
+        CallTargets noTargets;
+        deque<CallTargets> mergedTargets; // 同一个操作数以不同签名被调用时合并的目标集合
+        FunctionModel funcModel; // 库函数 -> 调用点上的传播方式
+        ReverseCallGraph callGraph; // 被调函数 -> 所有可能调用它的call/invoke
+        DenseMap<Type *, bool> taintSourceTypes; // 类型 -> 是否敏感(不考虑TBAA)
+        DenseMap<MDNode *, bool> funcPtrTags; // TBAATag -> 是否标识了函数指针
         unordered_set<Function *> tiantVarArgs;
         unordered_set<Function *> tiantReturnFuncs;
         DenseMap<Function*, vector<Value*>> func2RetValue;
-        PointerAnalysis *pta;
-
-        /*debug*/
-        DenseMap<Type *, vector<Type *>> Routes;
+        DenseMap<Function *, unique_ptr<DominatorTree>> domTrees; // 每个函数的支配树只构建一次
+        AnalysisStats stats; // 各阶段的耗时和内存
+        unique_ptr<SVFContext> svf; // 本次运行共享的SVFModule/SVFIR和指针分析
+        PointerAnalysis *pta = nullptr;
+        unique_ptr<CollateDDAClient> ddaClient; // 只查询被污染的load/store的指针
+        unique_ptr<ValueIndex> valueIndex; // 所有污点集合共享的Value编号
+        uint32_t numIndexedValues; // ValueIndex构造时预先编号的值的个数
+        deque<CallTargets> cachedTargets; // 从缓存中读出的间接调用目标集合
     };
 }
 
@@ -0,0 +1,66 @@
+#ifndef COLLATE_DDA_CLIENT_HPP
+#define COLLATE_DDA_CLIENT_HPP
+
+#include "llvm/IR/Value.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+
+#include "DDA/DDAClient.h"
+
+#include <vector>
+#include <utility>
+
+namespace COLLATE
+{
+    /*只回答COLLATE需要的查询的DDA客户端。
+      SVF默认的DDAClient会查询所有有效指针；这里的查询集合只包含被污染的load/store的指针操作数，
+      按PAG节点去重后由answerQueries一次回答完，
+      结果按查询的指针存放在连续的数组中，getMemOfCrData直接查表，不再逐个访问PAG。
+    */
+    class CollateDDAClient : public SVF::DDAClient
+    {
+    public:
+        explicit CollateDDAClient(SVF::SVFModule *module) : DDAClient(module) {}
+
+        // 在answerQueries之前加入要查询的指针
+        void addQuery(const llvm::Value *ptr);
+
+        SVF::OrderedNodeSet &collectCandidateQueries(SVF::SVFIR *pag) override;
+
+        /*所有查询的总时间预算(秒，0表示不限制)。
+          预算用完后不再发起新的查询，剩下的查询使用fallback(通常是Andersen)的结果。
+          单个查询的步数预算由DPItem::setMaxBudget控制，超出时SVF自己会退回Andersen的结果。
+        */
+        void setTimeBudget(double seconds, SVF::PointerAnalysis *fallback)
+        {
+            timeBudget = seconds;
+            fallbackPTA = fallback;
+        }
+
+        void answerQueries(SVF::PointerAnalysis *pta) override;
+
+        // 把每个查询的指向集转换为内存对象保存下来。
+        // 按需分析时在answerQueries之后调用，全程序分析时直接调用
+        void collectResults(SVF::PointerAnalysis *pta);
+
+        // 查询的指针可能指向的内存对象，不是查询或没有PAG节点的指针返回空
+        llvm::ArrayRef<llvm::Value *> getPointsTo(const llvm::Value *ptr) const;
+
+        unsigned getNumQueries() const { return queries.size(); }
+        unsigned getNumFallbacks() const { return numFallbacks; }
+
+    private:
+        llvm::SetVector<const llvm::Value *> queries;
+        llvm::DenseMap<const llvm::Value *, std::pair<uint32_t, uint32_t>> ranges; // 指针 -> objects中的区间
+        std::vector<llvm::Value *> objects;
+
+        double timeBudget = 0;
+        SVF::PointerAnalysis *fallbackPTA = nullptr;
+        llvm::DenseSet<SVF::NodeID> answered; // 在时间预算内回答了的查询
+        unsigned numFallbacks = 0;
+    };
+}
+
+#endif
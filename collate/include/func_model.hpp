@@ -0,0 +1,61 @@
+#ifndef COLLATE_FUNC_MODEL_HPP
+#define COLLATE_FUNC_MODEL_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace COLLATE
+{
+    /*库函数的模型：决定调用点上的污点如何在实参和形参之间传播。
+      内置的模型是原来handleCallsite中的两张表，还可以从模型文件追加，格式为每行一条：
+          ignore   <函数名>    # 不在实参和形参之间传播污点
+          propagate <函数名>   # 前两个实参互相传播，如memcpy
+      函数名以*结尾表示前缀匹配，#之后是注释。
+      classify在分析开始前给模块中的每个函数确定一次类别，传播时只需查表，不再比较字符串。
+    */
+    class FunctionModel
+    {
+    public:
+        enum Kind : uint8_t
+        {
+            Normal,        // 按形参和实参的对应关系传播
+            Ignored,       // 不传播
+            ArgPropagator, // 前两个实参互相传播
+            Intrinsic      // 其他llvm内建函数，不传播
+        };
+
+        FunctionModel();
+
+        // 出错时返回false并在error中给出原因，已经读到的规则仍然有效
+        bool loadFile(llvm::StringRef path, std::string &error);
+
+        void classify(llvm::Module &M);
+
+        Kind getKind(const llvm::Function *F) const
+        {
+            auto it = kinds.find(F);
+            return it == kinds.end() ? Normal : it->second;
+        }
+
+        // 追加的模型文件内容的摘要，用于缓存键
+        const std::string &getFingerprint() const { return fingerprint; }
+
+    private:
+        void addRule(llvm::StringRef pattern, Kind kind);
+        Kind match(const llvm::Function &F) const;
+
+        llvm::StringMap<Kind> exact;
+        std::vector<std::pair<std::string, Kind>> prefixes;
+        llvm::DenseMap<const llvm::Function *, Kind> kinds;
+        std::string fingerprint;
+    };
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef COLLATE_INCREMENTAL_STATE_HPP
+#define COLLATE_INCREMENTAL_STATE_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MD5.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace COLLATE
+{
+    // 去掉链接时追加的数字后缀(可能有多层)，如struct.ngx_http_connection_t.1248 -> struct.ngx_http_connection_t
+    llvm::StringRef stripNumericSuffix(llvm::StringRef name);
+
+    /*函数内值的局部编号：形参在前，指令按inst_iterator顺序在后。
+      函数内容不变时局部编号不变，因此可以跨编译保存函数内的分析结果。
+      槽位(局部编号, 操作数序号+1)表示该值本身(序号为0)或该指令的某个操作数，
+      后者用于记录常量等不属于任何函数的值。
+    */
+    class FunctionSlots
+    {
+    public:
+        typedef std::pair<uint32_t, uint32_t> Slot;
+
+        explicit FunctionSlots(llvm::Function &F);
+
+        // 槽位越界(状态文件损坏)时返回nullptr
+        llvm::Value *get(Slot S) const;
+
+        const std::vector<llvm::Value *> &getLocals() const { return locals; }
+
+    private:
+        std::vector<llvm::Value *> locals;
+    };
+
+    /*增量分析在两次运行之间保存的状态。
+      每个函数记录内容哈希和上一次分析得到的函数内结果，
+      内容未变且不受变化函数影响的函数直接复用这些结果。
+    */
+    class IncrementalState
+    {
+    public:
+        static const uint32_t Version = 3;
+
+        struct FunctionState
+        {
+            llvm::MD5::MD5Result hash;
+            bool taintedReturn = false;              // 是否在tiantReturnFuncs中
+            bool taintedVarArgs = false;             // 是否在tiantVarArgs中
+            std::vector<FunctionSlots::Slot> sources; // 函数内的污点源
+            std::vector<FunctionSlots::Slot> tainted; // 函数内被污染的值
+            std::vector<std::string> callees;         // 可能的被调函数，函数被删除时用于找到受影响的函数
+        };
+
+        /*函数内容的哈希，直接对操作码、类型和操作数的局部编号计算，不打印成文本。
+          结构体类型只按去掉数字后缀的名字计入，其他翻译单元变化导致的重新编号不影响结果；
+          忽略调试信息和元数据附件(它们的编号是模块全局的，其他函数变化时也会改变)，
+          TBAA只保留访问类型的名字，这是污点源识别唯一用到的部分。
+        */
+        static llvm::MD5::MD5Result hashFunction(llvm::Function &F);
+
+        /*全局值以外的常量(null、整数等)被所有函数共享，它们的污点也会跨函数传播。
+          常量按种类(整数还包括位宽和值)记录，不含类型，跨编译稳定；不同常量可能得到相同的键，只会偏保守*/
+        static std::string getConstantKey(const llvm::Constant *C);
+
+        // options是影响分析结果的选项，与保存时不同则视为没有状态
+        bool load(llvm::StringRef path, llvm::StringRef options);
+        bool store(llvm::StringRef path, llvm::StringRef options) const;
+
+        std::vector<std::string> sensitiveTypes; // 排好序的敏感结构体名，变化时不能复用任何结果
+        std::vector<std::string> taintedGlobals;
+        std::vector<std::string> taintedConstants; // getConstantKey的结果，排好序
+        llvm::StringMap<FunctionState> functions;
+    };
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef COLLATE_MANIFEST_HPP
+#define COLLATE_MANIFEST_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+
+#include <vector>
+
+namespace COLLATE
+{
+    /*需要保护的内存对象的编号和二进制清单。
+      分析结束后先用tagSites给受保护的alloca和分配调用写上!collate.site编号，
+      后续的变换(safe region的分配器、影子栈)按编号识别这些对象，替换指令时把编号带到新的指令上。
+      所有变换完成后emit把清单写入插桩后程序的collate_manifest段，布局见runtime/include/collate_manifest.h：
+      全局变量记录最终的地址和大小，栈对象和堆分配点记录编号、大小以及是否已放入safe region。
+    */
+    class ManifestEmitter
+    {
+    public:
+        static const char *const SiteMDName;
+
+        explicit ManifestEmitter(llvm::Module &M) : M(M) {}
+
+        // 不是全局变量、alloca或调用的值被忽略
+        void addObject(llvm::Value *V);
+
+        // 给栈对象和分配点按加入的顺序编号，写入!collate.site
+        void tagSites();
+
+        // 全局变量被移动到safe data块中时记录它的新地址
+        void relocateGlobal(llvm::GlobalVariable *G, llvm::Constant *addr) { globalAddrs[G] = addr; }
+
+        // 模块中已经有清单或目标不是64位时返回nullptr
+        llvm::GlobalVariable *emit();
+
+        // tagSites写入的编号，没有时返回~0U
+        static unsigned getSiteID(const llvm::Instruction *I);
+
+    private:
+        uint64_t getAllocSize(llvm::CallBase *CB);
+
+        struct Site
+        {
+            bool isStack;
+            uint64_t size; // 0表示编译时未知
+        };
+
+        llvm::Module &M;
+        llvm::SetVector<llvm::GlobalVariable *> globals;
+        llvm::SetVector<llvm::AllocaInst *> stackSlots;
+        llvm::SetVector<llvm::CallBase *> allocSites;
+        llvm::DenseMap<llvm::GlobalVariable *, llvm::Constant *> globalAddrs;
+        std::vector<Site> sites; // 按编号
+    };
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef COLLATE_MPK_GATE_HPP
+#define COLLATE_MPK_GATE_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+
+namespace COLLATE
+{
+    /*在trusted指令前后内联打开/关闭safe region访问的rdpkru/wrpkru序列。
+      序列读取运行时(runtime/mpk)导出的掩码，只修改COLLATE的pkey对应的位，
+      运行时没有启用MPK时整段跳过。序列只是一条带内存clobber的inline asm，
+      不拆分基本块，编译器也不会把内存访问移出开关之间。
+    */
+    class MPKGate
+    {
+    public:
+        explicit MPKGate(llvm::Module &M);
+
+        // 在I之前插入open
+        void insertOpen(llvm::Instruction *I);
+        // 在I之后插入close，I是invoke时在它的两个后继开头插入，I不能是其他terminator
+        void insertClose(llvm::Instruction *I);
+
+        /*减少执行时写PKRU的次数，trusted是函数中被授权访问safe region的指令。
+          开关之间只允许trusted指令和不访问内存、不会抛出异常的指令，否则未授权的访问也能进入safe region，
+          或者异常离开时safe region没有关闭：
+          1. 外提：循环中只有trusted访问时，去掉循环内的开关，在preheader打开、在出口关闭；
+          2. 块内合并：close之后到下一个open之前没有其他访问时，去掉这一对；
+          3. 跨块合并：块末尾的close与所有只有它一个前驱的后继开头的open抵消。
+        */
+        void optimize(llvm::Function &F, const llvm::SmallPtrSetImpl<llvm::Instruction *> &trusted,
+                          llvm::LoopInfo &LI);
+
+        // 目标不是x86-64时不插桩
+        bool isSupported() const { return supported; }
+
+        // 插入的(包括外提时新插入的)和被去掉的开关个数
+        unsigned getNumGates() const { return numGates; }
+        unsigned getNumRemoved() const { return numRemoved; }
+
+    private:
+        llvm::GlobalVariable *getRuntimeVar(llvm::Module &M, llvm::StringRef name);
+        void setElementTypes(llvm::CallInst *CI);
+        void emitOpen(llvm::Instruction *insertBefore);
+        void emitClose(llvm::Instruction *insertBefore);
+
+        bool isOpen(const llvm::Instruction *I) const;
+        bool isClose(const llvm::Instruction *I) const;
+        bool isSafe(const llvm::Instruction *I, const llvm::SmallPtrSetImpl<llvm::Instruction *> &trusted) const;
+
+        bool hoistLoop(llvm::Loop *L, const llvm::SmallPtrSetImpl<llvm::Instruction *> &trusted);
+        void coalesceInBlock(llvm::BasicBlock &BB, const llvm::SmallPtrSetImpl<llvm::Instruction *> &trusted);
+        void coalesceAcrossBlocks(llvm::Function &F, const llvm::SmallPtrSetImpl<llvm::Instruction *> &trusted);
+        void erase(llvm::Instruction *gate);
+
+        bool supported;
+        llvm::InlineAsm *openAsm = nullptr;
+        llvm::InlineAsm *closeAsm = nullptr;
+        llvm::GlobalVariable *enabled = nullptr;
+        llvm::GlobalVariable *openMask = nullptr;
+        llvm::GlobalVariable *closeMask = nullptr;
+        unsigned numGates = 0;
+        unsigned numRemoved = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef COLLATE_REPORT_WRITER_HPP
+#define COLLATE_REPORT_WRITER_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace COLLATE
+{
+    /*报告中引用的源文件。每个文件只打开一次(大文件由MemoryBuffer映射到内存)，
+      第一次取行时建立行首偏移的索引，之后按行号直接定位。
+    */
+    class SourceCache
+    {
+    public:
+        // 文件不存在或行号越界时返回空串
+        llvm::StringRef getLine(llvm::StringRef path, unsigned line);
+
+    private:
+        struct SourceFile
+        {
+            std::unique_ptr<llvm::MemoryBuffer> buffer; // 打不开的文件为空，避免重复尝试
+            std::vector<uint32_t> lineOffsets;
+        };
+
+        llvm::StringMap<SourceFile> files;
+    };
+
+    /*constraining data的报告。输出经过缓冲，格式可以是：
+        text  与原来的dumpCrData相同，供人阅读
+        json  对象数组，每个对象有id、kind、function、file、line、source、ir
+        csv   同样的字段，第一行是表头
+    */
+    class ReportWriter
+    {
+    public:
+        enum Format
+        {
+            Text,
+            JSON,
+            CSV
+        };
+
+        ReportWriter(llvm::raw_ostream &OS, Format format, const llvm::Module &M);
+        ~ReportWriter();
+
+        void addInstruction(const llvm::Instruction *I);
+        void addGlobal(const llvm::GlobalVariable *G);
+
+    private:
+        void addEntry(llvm::StringRef kind, llvm::StringRef function, llvm::StringRef file, unsigned line, const llvm::Value *V);
+        void writeCSVField(llvm::StringRef field);
+
+        llvm::raw_ostream &OS;
+        Format format;
+        llvm::ModuleSlotTracker MST;
+        SourceCache sources;
+        std::unique_ptr<llvm::json::OStream> json;
+        unsigned num = 0;
+        std::string ir;
+    };
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef COLLATE_SAFE_HEAP_HPP
+#define COLLATE_SAFE_HEAP_HPP
+
+#include "llvm/IR/Module.h"
+
+namespace COLLATE
+{
+    /*把控制相关的堆对象放入safe region的分配器(runtime/allocator)。
+      带有!collate.site编号的分配调用改为调用collate_safe_*；
+      模块中所有的free/realloc/delete(包括被取地址的)改为按地址范围分派的collate_free等，
+      因为safe region中的对象可能在任何地方被释放。
+    */
+    class SafeHeap
+    {
+    public:
+        explicit SafeHeap(llvm::Module &M) : M(M) {}
+
+        // 返回被改写的分配点个数，不认识的分配函数保持不变
+        unsigned redirectAllocSites();
+
+        // 返回被替换的释放函数个数，模块自己定义的同名函数不替换
+        unsigned redirectDeallocations();
+
+    private:
+        llvm::Module &M;
+    };
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef COLLATE_SAFE_PLACEMENT_HPP
+#define COLLATE_SAFE_PLACEMENT_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+
+namespace COLLATE
+{
+    /*在编译时把受保护的全局变量和栈对象放进safe region，访问时不需要额外的间接或注册。
+      全局变量：模块中所有被标记的全局变量合并为一个按页对齐、大小为整页的块，放在collate_safe_data段中，
+      运行时在main开始时用COLLATE的pkey保护整个段；原来的符号保留为指向块中对应字段的别名。
+      栈对象：被标记的静态alloca改为在影子栈(runtime/shadow-stack)上分配，
+      函数入口移动线程本地的影子栈指针，每个出口和landingpad恢复。
+    */
+    class SafePlacement
+    {
+    public:
+        static const char *const SectionName;
+
+        explicit SafePlacement(llvm::Module &M) : M(M) {}
+
+        // 返回被移动的全局变量个数，不能移动的(声明、可被替换的定义、TLS、有指定段等)保持不变
+        unsigned relocateGlobals(llvm::ArrayRef<llvm::GlobalVariable *> globals);
+
+        // 被移动的全局变量在safe data块中的新地址(别名或字段)
+        const llvm::DenseMap<llvm::GlobalVariable *, llvm::Constant *> &getRelocatedGlobals() const { return relocated; }
+
+        // 返回被移动的alloca个数，函数的CFG被修改过时调用者需要丢弃它的支配树
+        unsigned relocateAllocas(llvm::Function &F, llvm::ArrayRef<llvm::AllocaInst *> allocas);
+
+        // 没有影子栈对象但会捕获异常的函数在landingpad恢复进入时的影子栈指针，
+        // 否则被展开的插桩函数的帧会一直留在影子栈上；返回是否插入了恢复
+        bool restoreOnUnwind(llvm::Function &F);
+
+        // 在main的入口调用运行时保护collate_safe_data段
+        void insertProtectCall();
+
+    private:
+        bool canRelocate(llvm::GlobalVariable *G);
+        bool canRelocate(llvm::Function &F);
+        llvm::GlobalVariable *getShadowStackPointer();
+        void restoreAtEHPads(llvm::Function &F, llvm::Value *sp);
+
+        llvm::Module &M;
+        llvm::DenseMap<llvm::GlobalVariable *, llvm::Constant *> relocated;
+    };
+}
+
+#endif
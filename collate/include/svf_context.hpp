@@ -0,0 +1,53 @@
+#ifndef COLLATE_SVF_CONTEXT_HPP
+#define COLLATE_SVF_CONTEXT_HPP
+
+#include "llvm/IR/Module.h"
+
+#include "SVF-FE/LLVMUtil.h"
+#include "DDA/DDAClient.h"
+#include "WPA/Andersen.h"
+
+#include <memory>
+
+namespace SVF
+{
+    class SVFG;
+}
+
+namespace COLLATE
+{
+    /*一次运行中共享的SVF对象，所有阶段都从这里取，析构时按依赖的逆序统一释放。
+      构造时只构建SVFModule：SVF在这一步会规范化IR(拆分常量GEP、合并返回指令)，
+      因此必须在给Value编号之前构造，缓存命中时也一样，保证编号与写缓存时一致。
+      符号表和SVFIR等到第一次需要时才构建，使之能看到constantExpr2Instruction之后的IR。
+    */
+    class SVFContext
+    {
+    public:
+        explicit SVFContext(llvm::Module &M);
+        ~SVFContext();
+
+        SVF::SVFModule *getSVFModule() const { return svfModule; }
+        SVF::SVFIR *getPAG();
+
+        // 全程序分析，SVF中都是单例，由本对象负责释放
+        SVF::AndersenWaveDiff *getAndersen();
+        SVF::PointerAnalysis *getFlowSensitive();
+
+        // 基于Andersen结果的完整SVFG，供SVFG污点传播使用
+        SVF::SVFG *getSVFG();
+
+        // 按需分析，client须比本对象活得更久
+        SVF::PointerAnalysis *createContextDDA(SVF::DDAClient *client);
+
+    private:
+        SVF::SVFModule *svfModule = nullptr;
+        SVF::SVFIR *pag = nullptr;
+        SVF::AndersenWaveDiff *andersen = nullptr;
+        SVF::PointerAnalysis *fspta = nullptr;
+        std::unique_ptr<SVF::SVFG> svfg;
+        std::unique_ptr<SVF::PointerAnalysis> cxtDDA;
+    };
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef COLLATE_SVFG_TAINT_HPP
+#define COLLATE_SVFG_TAINT_HPP
+
+#include "taint_set.hpp"
+
+#include "Graphs/SVFG.h"
+
+namespace COLLATE
+{
+    /*基于稀疏值流图(SVFG)的污点传播。
+      从污点源的定义节点出发沿SVFG的出边前向遍历：顶层指针沿直接边传播，
+      经过内存的值沿store到load的间接边传播，不需要像规则引擎那样反复扫描指令。
+      规则引擎双向传播的语句(store、load、getelementptr、bitcast、phi和参数传递)还沿直接的入边反向遍历，
+      因此通过指针写入的控制数据也会被污染。
+      每个节点只访问一次，到达的节点对应的LLVM值加入污点集合：
+      定义顶层变量的节点取其左值，store节点取store指令本身(与规则引擎一致)。
+    */
+    class SVFGTaintEngine
+    {
+    public:
+        SVFGTaintEngine(SVF::SVFIR *pag, const SVF::SVFG *svfg) : pag(pag), svfg(svfg) {}
+
+        void propagate(const TaintSet &source, TaintSet &tainted);
+
+        unsigned getNumVisited() const { return numVisited; }
+
+    private:
+        llvm::Value *getTaintedValue(const SVF::VFGNode *node) const;
+        static bool propagatesBackward(const SVF::VFGNode *node);
+
+        SVF::SVFIR *pag;
+        const SVF::SVFG *svfg;
+        unsigned numVisited = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef COLLATE_TAINT_SET_HPP
+#define COLLATE_TAINT_SET_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <vector>
+#include <cassert>
+
+namespace COLLATE
+{
+    /*给Value分配稠密的整数编号，所有污点集合共享同一套编号。
+      全局变量、函数、形参、指令及指令的操作数在构造时按模块顺序编号，因此同一个模块上的编号是确定的，
+      并且传播过程中不会再分配新编号(并行传播时各线程只读查询)；
+      其他值在第一次被加入集合时才编号。
+      预先编号的值之间的使用关系也按编号以CSR形式保存：指令的操作数(函数对应它的形参)和使用它的指令，
+      传播时沿编号访问操作数和使用者，成员判断直接测试位，不再经过哈希表。
+    */
+    class ValueIndex
+    {
+    public:
+        static const unsigned InvalidID = ~0U;
+
+        explicit ValueIndex(llvm::Module &M)
+        {
+            for (auto &G : M.globals())
+                getID(&G);
+            for (auto &F : M)
+            {
+                getID(&F);
+                for (auto &A : F.args())
+                    getID(&A);
+                for (llvm::inst_iterator I = llvm::inst_begin(F), E = llvm::inst_end(F); I != E; ++I)
+                {
+                    getID(&(*I));
+                    for (llvm::Value *op : I->operands())
+                        getID(op);
+                }
+            }
+            buildUses();
+        }
+
+        unsigned getID(const llvm::Value *V)
+        {
+            auto res = ids.insert(std::make_pair(V, (unsigned)values.size()));
+            if (res.second)
+                values.push_back(const_cast<llvm::Value *>(V));
+            return res.first->second;
+        }
+
+        // 不分配编号，没有编号的值返回InvalidID
+        unsigned lookup(const llvm::Value *V) const
+        {
+            auto it = ids.find(V);
+            return it == ids.end() ? InvalidID : it->second;
+        }
+
+        llvm::Value *getValue(unsigned ID) const { return values[ID]; }
+        unsigned size() const { return values.size(); }
+
+        // 指令按顺序的操作数编号，函数的形参编号；其他值和之后才编号的值为空
+        llvm::ArrayRef<unsigned> getOperands(unsigned ID) const
+        {
+            if (ID + 1 >= opOffsets.size())
+                return llvm::ArrayRef<unsigned>();
+            return llvm::makeArrayRef(opIDs).slice(opOffsets[ID], opOffsets[ID + 1] - opOffsets[ID]);
+        }
+
+        // 以该值为操作数的指令，同一条指令多次使用时出现多次
+        llvm::ArrayRef<unsigned> getUsers(unsigned ID) const
+        {
+            if (ID + 1 >= userOffsets.size())
+                return llvm::ArrayRef<unsigned>();
+            return llvm::makeArrayRef(userIDs).slice(userOffsets[ID], userOffsets[ID + 1] - userOffsets[ID]);
+        }
+
+    private:
+        void buildUses()
+        {
+            unsigned n = values.size();
+            opOffsets.assign(n + 1, 0);
+            userOffsets.assign(n + 1, 0);
+            for (unsigned i = 0; i < n; i++)
+            {
+                opOffsets[i] = opIDs.size();
+                if (llvm::Instruction *I = llvm::dyn_cast<llvm::Instruction>(values[i]))
+                {
+                    for (llvm::Value *op : I->operands())
+                    {
+                        unsigned opID = lookup(op);
+                        opIDs.push_back(opID);
+                        userOffsets[opID + 1]++;
+                    }
+                }
+                else if (llvm::Function *F = llvm::dyn_cast<llvm::Function>(values[i]))
+                {
+                    for (auto &A : F->args())
+                        opIDs.push_back(lookup(&A));
+                }
+            }
+            opOffsets[n] = opIDs.size();
+
+            // 按操作数做一次计数排序得到使用者
+            for (unsigned i = 0; i < n; i++)
+                userOffsets[i + 1] += userOffsets[i];
+            std::vector<unsigned> next(userOffsets.begin(), userOffsets.end() - 1);
+            userIDs.resize(userOffsets[n]);
+            for (unsigned i = 0; i < n; i++)
+            {
+                if (!llvm::isa<llvm::Instruction>(values[i]))
+                    continue;
+                for (unsigned opID : getOperands(i))
+                    userIDs[next[opID]++] = i;
+            }
+        }
+
+        llvm::DenseMap<const llvm::Value *, unsigned> ids;
+        std::vector<llvm::Value *> values;
+        std::vector<unsigned> opOffsets;
+        std::vector<unsigned> opIDs;
+        std::vector<unsigned> userOffsets;
+        std::vector<unsigned> userIDs;
+    };
+
+    /*以位向量存储的Value集合：成员判断是一次位测试，集合合并是按字的或运算*/
+    class TaintSet
+    {
+    public:
+        class const_iterator
+        {
+        public:
+            const_iterator(const TaintSet *set, int id) : set(set), id(id) {}
+            llvm::Value *operator*() const { return set->index->getValue(id); }
+            const_iterator &operator++()
+            {
+                id = set->bits.find_next(id);
+                return *this;
+            }
+            bool operator==(const const_iterator &other) const { return id == other.id; }
+            bool operator!=(const const_iterator &other) const { return id != other.id; }
+
+        private:
+            const TaintSet *set;
+            int id;
+        };
+
+        explicit TaintSet(ValueIndex &index) : index(&index) {}
+
+        bool count(const llvm::Value *V) const { return test(index->lookup(V)); }
+        bool insert(llvm::Value *V) { return set(index->getID(V)); }
+
+        // 已知编号时直接测试和设置位
+        bool test(unsigned id) const { return id < bits.size() && bits.test(id); }
+
+        bool set(unsigned id)
+        {
+            if (id >= bits.size())
+                bits.resize(index->size());
+            if (bits.test(id))
+                return false;
+            bits.set(id);
+            return true;
+        }
+
+        // 按编号遍历集合中的值
+        llvm::iterator_range<llvm::BitVector::const_set_bits_iterator> ids() const { return bits.set_bits(); }
+
+        TaintSet &operator|=(const TaintSet &other)
+        {
+            assert(index == other.index && "taint sets over different value indexes");
+            bits |= other.bits;
+            return *this;
+        }
+
+        const_iterator begin() const { return const_iterator(this, bits.find_first()); }
+        const_iterator end() const { return const_iterator(this, -1); }
+
+        unsigned size() const { return bits.count(); }
+        bool empty() const { return bits.none(); }
+        void clear() { bits.reset(); }
+
+        ValueIndex &getIndex() const { return *index; }
+
+    private:
+        ValueIndex *index;
+        llvm::BitVector bits;
+    };
+}
+
+#endif
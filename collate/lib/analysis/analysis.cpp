@@ -1,5 +1,131 @@
 #include "../../include/collate.hpp"
 
+#define DEBUG_TYPE "collate"
+
+STATISTIC(NumTaintSources, "Number of taint sources");
+STATISTIC(NumTaintedValues, "Number of tainted values");
+STATISTIC(NumCrData, "Number of control-related data");
+STATISTIC(NumProtectedMems, "Number of protected memory objects");
+STATISTIC(NumPTAQueries, "Number of points-to queries");
+STATISTIC(NumPropagationRounds, "Number of taint propagation rounds");
+STATISTIC(NumSafeAllocSites, "Number of allocation sites redirected to the safe region allocator");
+STATISTIC(NumSafeGlobals, "Number of global variables moved into the safe data section");
+STATISTIC(NumShadowSlots, "Number of stack slots moved onto the shadow stack");
+STATISTIC(NumGates, "Number of inlined MPK gate sequences");
+STATISTIC(NumGatesRemoved, "Number of MPK gate sequences removed by coalescing and hoisting");
+
+static cl::opt<string> CollateCacheDir("collate-cache-dir",
+    cl::desc("Directory of the persistent COLLATE analysis cache (disabled if empty)"),
+    cl::init(""));
+
+static cl::opt<string> CollateIncremental("collate-incremental",
+    cl::desc("State file for re-analyzing only the functions changed since the last run (disabled if empty)"),
+    cl::init(""));
+
+enum TaintEngine
+{
+    TE_Rules,
+    TE_SVFG
+};
+
+static cl::opt<TaintEngine> CollateTaintEngine("collate-taint-engine",
+    cl::desc("How taint is propagated from the sources"),
+    cl::values(
+        clEnumValN(TE_Rules, "rules", "Per-instruction propagation rules (default)"),
+        clEnumValN(TE_SVFG, "svfg", "Forward traversal of the sparse value-flow graph")),
+    cl::init(TE_Rules));
+
+enum PTABackend
+{
+    PTA_Andersen,
+    PTA_FlowSensitive,
+    PTA_ContextDDA
+};
+
+static cl::opt<PTABackend> CollatePTA("collate-pta",
+    cl::desc("Pointer analysis used to find the memory of control-related data"),
+    cl::values(
+        clEnumValN(PTA_Andersen, "andersen", "Andersen wave-diff (fastest, least precise)"),
+        clEnumValN(PTA_FlowSensitive, "fspta", "Whole-program flow-sensitive analysis"),
+        clEnumValN(PTA_ContextDDA, "cxt-dda", "Demand-driven context-sensitive analysis (default)")),
+    cl::init(PTA_ContextDDA));
+
+static cl::opt<unsigned> CollatePTAMaxPathLen("collate-pta-max-path",
+    cl::desc("Maximum path length of cxt-dda queries"),
+    cl::init(100000));
+
+static cl::opt<unsigned> CollatePTAMaxCxtLen("collate-pta-max-cxt",
+    cl::desc("Maximum context length of cxt-dda queries"),
+    cl::init(3));
+
+static cl::opt<unsigned> CollatePTAStepBudget("collate-pta-step-budget",
+    cl::desc("Steps per cxt-dda query before falling back to Andersen (0 = SVF default)"),
+    cl::init(0));
+
+static cl::opt<double> CollatePTATimeBudget("collate-pta-time-budget",
+    cl::desc("Seconds for all cxt-dda queries; unanswered queries fall back to Andersen (0 = unlimited)"),
+    cl::init(0));
+
+static cl::opt<string> CollateFuncModel("collate-func-model",
+    cl::desc("File with extra 'ignore <name>' / 'propagate <name>' library function models"),
+    cl::init(""));
+
+static cl::opt<string> CollateReport("collate-report",
+    cl::desc("File for the report of control-related data (default: stderr)"),
+    cl::init(""));
+
+static cl::opt<ReportWriter::Format> CollateReportFormat("collate-report-format",
+    cl::desc("Format of the control-related data report"),
+    cl::values(
+        clEnumValN(ReportWriter::Text, "text", "Human-readable listing (default)"),
+        clEnumValN(ReportWriter::JSON, "json", "JSON array of entries"),
+        clEnumValN(ReportWriter::CSV, "csv", "Comma-separated values with a header row")),
+    cl::init(ReportWriter::Text));
+
+static cl::opt<bool> CollateSafeHeap("collate-safe-heap",
+    cl::desc("Allocate control-related heap objects from the safe region allocator (requires -collate-mpk)"),
+    cl::init(false));
+
+static cl::opt<bool> CollateSafeData("collate-safe-data",
+    cl::desc("Move control-related globals into the page-aligned collate_safe_data section (requires -collate-mpk)"),
+    cl::init(false));
+
+static cl::opt<bool> CollateSafeStack("collate-safe-stack",
+    cl::desc("Allocate control-related stack slots on the protected shadow stack (requires -collate-mpk)"),
+    cl::init(false));
+
+static cl::opt<bool> CollateMPK("collate-mpk",
+    cl::desc("Gate trusted instructions with inlined rdpkru/wrpkru sequences"),
+    cl::init(false));
+
+static cl::opt<bool> CollateMPKCoalesce("collate-mpk-coalesce",
+    cl::desc("Merge adjacent MPK gates and hoist them out of loops that only access the safe region"),
+    cl::init(true));
+
+static cl::opt<bool> CollateMPKPermissive("collate-mpk-permissive",
+    cl::desc("Let the runtime open the gate on faults from untrusted accesses instead of aborting"),
+    cl::init(false));
+
+static cl::opt<bool> CollateManifest("collate-manifest",
+    cl::desc("Embed the manifest of protected objects read by the runtime statistics (runtime/statistics)"),
+    cl::init(false));
+
+static cl::opt<bool> CollateStats("collate-stats",
+    cl::desc("Print the time and memory of each COLLATE analysis phase"),
+    cl::init(false));
+
+static cl::opt<string> CollateStatsJSON("collate-stats-json",
+    cl::desc("Write phase times, peak RSS and set sizes as JSON to this file"),
+    cl::init(""));
+
+static cl::opt<unsigned> CollateThreads("collate-threads",
+    cl::desc("Number of threads for intraprocedural taint propagation (1 = sequential)"),
+    cl::init(1));
+
+static cl::opt<bool> CollateVerify("collate-verify",
+    cl::desc("Redo an incremental analysis from scratch, recompute the trusted instructions on a cache hit, and abort on a difference"),
+    cl::init(false));
+
 void COLLATEPass::constantExpr2Instruction(Module &M)
 {
     for (auto &F : M)
@@ -76,47 +202,87 @@ void COLLATEPass::replaceCEOWithInstr(Instruction *I, Value *pointer)
     }
 }
 
+size_t COLLATEPass::layoutHash(Type *Ty)
+{
+    // clang在部分翻译单元中把结构体中的函数指针降为{}*(见isSensitiveType)，
+    // 这正是同一个结构体出现.NNNN变体的原因之一：所有函数指针和{}*按同一种类型哈希，
+    // 只在这些字段上不同的同名结构体仍然分在一类
+    if (PointerType *pTy = dyn_cast<PointerType>(Ty))
+    {
+        Type *elemTy = pTy->getElementType();
+        StructType *sTy = dyn_cast<StructType>(elemTy);
+        if (elemTy->isFunctionTy() || (sTy && sTy->isLiteral() && sTy->getNumElements() == 0))
+            return hash_combine(Type::PointerTyID, Type::FunctionTyID, pTy->getAddressSpace());
+    }
+
+    if (StructType *sTy = dyn_cast<StructType>(Ty))
+    {
+        // 嵌套的具名结构体只按名字参与哈希，避免在递归类型上无限展开
+        if (sTy->hasName())
+            return hash_combine(Type::StructTyID, stripNumericSuffix(sTy->getName()));
+        if (!sTy->isLiteral() || sTy->isOpaque())
+            return hash_combine(Type::StructTyID, sTy->isOpaque());
+    }
+
+    hash_code h = hash_combine(Ty->getTypeID(), Ty->getNumContainedTypes());
+    if (IntegerType *iTy = dyn_cast<IntegerType>(Ty))
+        h = hash_combine(h, iTy->getBitWidth());
+    else if (ArrayType *aTy = dyn_cast<ArrayType>(Ty))
+        h = hash_combine(h, aTy->getNumElements());
+    else if (VectorType *vTy = dyn_cast<VectorType>(Ty))
+        h = hash_combine(h, vTy->getElementCount().getKnownMinValue());
+    else if (StructType *sTy = dyn_cast<StructType>(Ty))
+        h = hash_combine(h, sTy->isPacked());
+    else if (FunctionType *fTy = dyn_cast<FunctionType>(Ty))
+        h = hash_combine(h, fTy->isVarArg());
+
+    for (Type *subTy : Ty->subtypes())
+        h = hash_combine(h, layoutHash(subTy));
+    return h;
+}
+
 void COLLATEPass::analyzeStructTypeEquality(Module &M)
 {
-    // 将所有结构体类型按前缀进行分类，如A.0和A.1分作一类
-    map<string, vector<StructType*>> stypesMap;
-    map<string, vector<StructType*>>::iterator it;
-    regex e("%\\w*\\.\\w*");
-    smatch result;
-    auto toTypeStr = [](Type* Ty)
-    {
-        string typeStr;
-        raw_string_ostream rso(typeStr);
-        Ty->print(rso);
-        return rso.str();
-    };
+    // 将所有结构体类型按去掉数字后缀的名字和布局进行分类：
+    // 如A.0和A.1布局相同则分作一类，同名但布局不同的类型不会被合并
+    DenseMap<pair<StringRef, size_t>, unsigned> classes;
+    StringMap<int> name2Class; // 名字 -> 唯一的布局类别，同名有多种布局时为-1
+    vector<StructType *> opaqueTypes;
+    unsigned n = 0;
 
     for(auto *S : M.getIdentifiedStructTypes())
     {
-        S = dyn_cast<StructType>(S);
-        string str = toTypeStr(S);
-        regex_search(str, result, e);
-        it = stypesMap.find(result.str());
-        if (it == stypesMap.end())
+        StringRef name = S->hasName() ? stripNumericSuffix(S->getName()) : StringRef();
+        if (S->isOpaque())
         {
-            vector<StructType*> tmp;
-            tmp.push_back(S);
-            stypesMap[result.str()] = tmp;
+            opaqueTypes.push_back(S);
+            continue;
         }
-        else
+
+        size_t layout = hash_combine(S->isPacked(), S->getNumElements());
+        for (Type *elemTy : S->elements())
+            layout = hash_combine(layout, layoutHash(elemTy));
+
+        auto res = classes.insert(make_pair(make_pair(name, layout), n));
+        if (res.second)
         {
-            (it->second).push_back(S);
+            n++;
+            auto nc = name2Class.insert(make_pair(name, (int)res.first->second));
+            if (!nc.second)
+                nc.first->second = -1;
         }
+        typeID[S] = res.first->second;
     }
 
-    // 给实际上相同的类型设置相同的标识符
-    it = stypesMap.begin();
-    for(int n = 0; it != stypesMap.end(); it++, n++)
+    // 只有声明的结构体(在某些文件中只用到了指针)没有布局，
+    // 如果同名的类型只有一种布局就归入那一类，否则单独成一类
+    for (auto *S : opaqueTypes)
     {
-        for(auto *S : it->second)
-        {
-            typeID[S] = n;
-        }
+        auto it = S->hasName() ? name2Class.find(stripNumericSuffix(S->getName())) : name2Class.end();
+        if (it != name2Class.end() && it->second >= 0)
+            typeID[S] = it->second;
+        else
+            typeID[S] = n++;
     }
 }
 
@@ -124,70 +290,66 @@ bool COLLATEPass::isEqual(Type *a, Type *b)
 {
     if(a == b) 
         return true;
-        
-    // 结构体类型的函数参数都为指针，所以需要比较指针指向的类型才对
-    Type *ta = a;
-    Type *tb = b;
-    PointerType *tmpType;
-    while (ta->isPointerTy() && tb->isPointerTy())
-    { 
-        tmpType = dyn_cast<PointerType>(ta);
-        ta = tmpType->getElementType();
-        tmpType = dyn_cast<PointerType>(tb);
-        tb = tmpType->getElementType();
-    }
 
-    // 如果都是结构体，就根据analyzeStructTypeEquality的结果进行分析
-    if(isa<StructType>(ta) && isa<StructType>(tb)) 
-    {
-        StructType *sa = dyn_cast<StructType>(ta);
-        StructType *sb = dyn_cast<StructType>(tb);
-        if(typeID[sa] == typeID[sb])
-        {
-            return true;
-        }
-    }  
-    return false;
+    return canonicalType(a) == canonicalType(b);
 }
 
-bool COLLATEPass::isTypeMatch(CallBase *CB, Function *F, Type *ReturnType)
+uintptr_t COLLATEPass::canonicalType(Type *Ty)
 {
-    auto fItr = F->arg_begin();
-    auto aItr = CB->arg_begin();
-
-    // 返回值类型不同，那F肯定不可能是CS调用的目标函数
-    if (!isEqual(ReturnType, F->getReturnType())) 
-        return false;
-
-    // 依次比较形参和实参的类型
-    while (fItr != F->arg_end() && aItr != CB->arg_end())
-    { 
-        Argument *formal = const_cast<Argument *>(&(*fItr));
-        Value *actual = *aItr;
-
-        if (!isEqual(formal->getType(), actual->getType()))
-            return false;
+    // 结构体类型的函数参数都为指针，所以需要比较指针指向的类型才对
+    Type *elemType = Ty;
+    uintptr_t depth = 0;
+    while (elemType->isPointerTy())
+    {
+        elemType = dyn_cast<PointerType>(elemType)->getElementType();
+        depth++;
+    }
 
-        ++fItr;
-        ++aItr;
+    // 指向结构体的指针用(指针层数, analyzeStructTypeEquality给出的类别)表示，
+    // 其他类型(包括没有类别的字面结构体)只和自己相等，直接用类型本身表示。
+    // Type按8字节对齐，最低位可用于区分两种表示
+    if (StructType *sTy = dyn_cast<StructType>(elemType))
+    {
+        auto it = typeID.find(sTy);
+        if (it != typeID.end())
+            return (((uintptr_t(it->second) << 8) | (depth & 0xff)) << 1) | 1;
     }
+    return reinterpret_cast<uintptr_t>(Ty);
+}
 
-    if (fItr == F->arg_end() && aItr == CB->arg_end())
-        return true;
+CallSignature COLLATEPass::getSignature(Function *F)
+{
+    CallSignature sig;
+    sig.push_back(canonicalType(F->getReturnType()));
+    for (auto &formal : F->args())
+        sig.push_back(canonicalType(formal.getType()));
+    return sig;
+}
 
-    return false;
+CallSignature COLLATEPass::getSignature(CallBase *CB)
+{
+    // 间接调用按实参的类型匹配，可变参数函数的实参可能比形参多
+    CallSignature sig;
+    sig.push_back(canonicalType(CB->getType()));
+    for (auto aItr = CB->arg_begin(); aItr != CB->arg_end(); ++aItr)
+        sig.push_back(canonicalType((*aItr)->getType()));
+    return sig;
 }
 
 void COLLATEPass::analyzeIndirectCalls(Module &M)
 {
-    // 找到所有被取地址的函数
-    unordered_set<Function*> AllFunctions;
+    // 找到所有被取地址的函数，按签名分桶。
+    // 签名相同当且仅当返回值和每个参数都满足isEqual，间接调用只需查找自己签名对应的桶
     for (auto &F : M)
     {
         if (F.hasAddressTaken())     
-            AllFunctions.insert(&F);
+            sig2Targets[getSignature(&F)].push_back(&F);
     }
 
+    // 被调用的操作数 -> 使用它的调用点按各自签名找到的目标集合(去重)
+    MapVector<Value *, SmallVector<const CallTargets *, 2>> operandTargets;
+    vector<CallBase *> calls;
+
     for (auto &F : M)
     {
         if (F.isDeclaration() || F.isIntrinsic())
@@ -196,176 +358,293 @@ void COLLATEPass::analyzeIndirectCalls(Module &M)
         for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
         { 
             Instruction *inst = &(*ii);
-            if (CallInst *cInst = dyn_cast<CallInst>(inst))
-            { 
-                if (!(cInst->getCalledFunction()))
-                {
-                    unordered_set<Function *> &targets = indirectCall2Target[cInst->getCalledOperand()]; 
-                    
-                    // 排除这种情况：
-                    // %23 = bitcast void (%struct.ngx_http_request_s.1250*, i64)* @ngx_http_finalize_request to void (%struct.ngx_http_request_s.1062*, i64)*
-                    //   call void %23(%struct.ngx_http_request_s.1062* %0, i64 %5), !dbg !105392
-                    // 此时函数指针实际上只能指向@ngx_http_finalize_request这一个函数
-                    bool done = false;
-                    if(isa<BitCastInst>(cInst->getCalledOperand()))
-                    {
-                        BitCastInst *bI = dyn_cast<BitCastInst>(cInst->getCalledOperand());
-                        Value *op = bI->getOperand(0);
-                        if(isa<Function>(op))
-                        {
-                            targets.insert(dyn_cast<Function>(op));
-                            done = true;
-                        }
-                    }
+            if (!isa<CallInst>(inst) && !isa<InvokeInst>(inst))
+                continue;
 
-                    if(!done)
-                    {
-                        // 通过类型匹配，找到间接调用可能的目标
-                        for (Function *tmpF : AllFunctions)
-                        {
-                            if (isTypeMatch(dyn_cast<CallBase>(cInst), tmpF, inst->getType())) 
-                                targets.insert(tmpF);                                                                                               
-                        }
-                    }
-                }
-                else
-                    directCall2Target[cInst] = cInst->getCalledFunction();
-            }
-            else if (InvokeInst *iInst = dyn_cast<InvokeInst>(inst))
+            CallBase *CB = dyn_cast<CallBase>(inst);
+            calls.push_back(CB);
+            if (CB->getCalledFunction())
             {
-                if (!(iInst->getCalledFunction()))
-                {
-                    unordered_set<Function *> &targets = indirectCall2Target[iInst->getCalledOperand()];
-                    bool done = false;
+                directCall2Target[CB] = CB->getCalledFunction();
+                continue;
+            }
 
-                    if(isa<BitCastInst>(iInst->getCalledOperand()))
-                    {
-                        BitCastInst *bI = dyn_cast<BitCastInst>(iInst->getCalledOperand());
-                        Value *op = bI->getOperand(0);
-                        if(isa<Function>(op))
-                        {
-                            targets.insert(dyn_cast<Function>(op));
-                            done = true;
-                        }
-                    }
-                    if(!done)
-                    {
-                        for (Function *tmpF : AllFunctions)
-                        {
-                            if (isTypeMatch(dyn_cast<CallBase>(iInst), tmpF, inst->getType()))
-                                targets.insert(tmpF);
-                        }
-                    }
-                }
-                else
-                    directCall2Target[iInst] = iInst->getCalledFunction();
+            const CallTargets *targets = &noTargets;
+            // 排除这种情况：
+            // %23 = bitcast void (%struct.ngx_http_request_s.1250*, i64)* @ngx_http_finalize_request to void (%struct.ngx_http_request_s.1062*, i64)*
+            //   call void %23(%struct.ngx_http_request_s.1062* %0, i64 %5), !dbg !105392
+            // 此时函数指针实际上只能指向@ngx_http_finalize_request这一个函数
+            BitCastInst *bI = dyn_cast<BitCastInst>(CB->getCalledOperand());
+            if (bI && isa<Function>(bI->getOperand(0)))
+            {
+                Function *op = dyn_cast<Function>(bI->getOperand(0));
+                CallTargets &single = singleTargets[op];
+                if (single.empty())
+                    single.push_back(op);
+                targets = &single;
             }
+            else
+            {
+                // 通过类型匹配，找到间接调用可能的目标。签名相同的调用点共享同一个目标集合
+                auto bucket = sig2Targets.find(getSignature(CB));
+                if (bucket != sig2Targets.end())
+                    targets = &bucket->second;
+            }
+
+            auto &sets = operandTargets[CB->getCalledOperand()];
+            if (!is_contained(sets, targets))
+                sets.push_back(targets);
+        }
+    }
+
+    // 同一个操作数被不同签名的调用点使用时(如以不同个数的实参调用可变参数的函数指针)，
+    // 它的目标是各签名目标集合的并集，与逐个调用点做类型匹配再合并的结果一致
+    for (auto &it : operandTargets)
+    {
+        if (it.second.size() == 1)
+        {
+            indirectCall2Target[it.first] = it.second.front();
+            continue;
         }
+
+        mergedTargets.emplace_back();
+        CallTargets &merged = mergedTargets.back();
+        SmallPtrSet<Function *, 16> seen;
+        for (const CallTargets *targets : it.second)
+            for (Function *target : *targets)
+                if (seen.insert(target).second)
+                    merged.push_back(target);
+        indirectCall2Target[it.first] = &merged;
+    }
+
+    callGraph.init(M);
+    for (CallBase *CB : calls)
+    {
+        if (Function *callee = CB->getCalledFunction())
+            callGraph.addEdge(callee, CB);
+        else
+            for (Function *target : *indirectCall2Target.lookup(CB->getCalledOperand()))
+                callGraph.addEdge(target, CB);
+    }
+    callGraph.finalize();
+}
+
+void COLLATEPass::identifyTaintSources(Module &M, TaintSet &result)
+{
+    classifyTypes(M);
+    identifyGlobalTaintSources(M, result);
+
+    for (auto &F : M)
+    {
+        identifyTaintSources(F, result);
+        collectReturnValues(F);
     }
 }
 
-void COLLATEPass::identifyTaintSources(Module &M, unordered_set<Value *> &result)
+void COLLATEPass::identifyGlobalTaintSources(Module &M, TaintSet &result)
 {
     for (auto const &G : M.globals())
     {
         Type *T = G.getType();
-        vector<Type*> route;
-        unordered_set<Type *> visited;
 
-        if(shouldProtectType(T, visited, route) && G.getNumUses() != 0)
+        if(isSensitiveType(T) && G.getNumUses() != 0)
             result.insert(const_cast<GlobalVariable*>(&G));
     }
+}
 
-    for (auto &F : M)
+void COLLATEPass::identifyTaintSources(Function &F, TaintSet &result)
+{
+    for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; I++)
     {
-        for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; I++)
-        {
-            vector<Type*> route;
-            unordered_set<Type *> visited;
+        if(isSensitiveType(I->getType()) && I->getNumUses() != 0)
+            result.insert(&(*I));
 
-            if(shouldProtectType(I->getType(), visited, route) && I->getNumUses() != 0)
-                result.insert(&(*I));
+        MDNode *TBAATag = I->getMetadata(LLVMContext::MD_tbaa);
+        for(int i = 0; i < I->getNumOperands(); i++)
+        {
+            Value *operand = I->getOperand(i);
 
-            for(int i = 0; i < I->getNumOperands(); i++)
+            if(isSensitiveType(operand->getType(), TBAATag))
             {
-                Value *operand = I->getOperand(i);
-                vector<Type*> route;
-                unordered_set<Type *> visited;
-
-                if(shouldProtectType(operand->getType(), visited, route, 
-                                    I->getMetadata(LLVMContext::MD_tbaa)))
-                {
-                    result.insert(operand);
-                    if(isa<StoreInst>(*I))
-                        result.insert(&(*I));
-                }
+                result.insert(operand);
+                if(isa<StoreInst>(*I))
+                    result.insert(&(*I));
             }
+        }
 
-            if(StoreInst *sI = dyn_cast<StoreInst>(&(*I)))
-            {
-                Value *pointer = sI->getPointerOperand();
-                Value *value = sI->getValueOperand();
+        if(StoreInst *sI = dyn_cast<StoreInst>(&(*I)))
+        {
+            Value *pointer = sI->getPointerOperand();
+            Value *value = sI->getValueOperand();
 
-                if (BitCastInst *bI = dyn_cast<BitCastInst>(pointer))
+            if (BitCastInst *bI = dyn_cast<BitCastInst>(pointer))
+            {
+                if (value->getType()->isPointerTy())
                 {
-                    if (value->getType()->isPointerTy())
-                    {
-                        Type *srcType = bI->getSrcTy();     
-                        Type *pointedType = cast<PointerType>(srcType)->getElementType();
-
-                        // 如果pointer原本指向的数据也是一个指针且这个指针的类型是敏感的
-                        if (pointedType->isPointerTy() && 
-                            shouldProtectType(pointedType, visited, route))
-                        { 
-                            result.insert(value);
-                            result.insert(pointer);
-                        }
+                    Type *srcType = bI->getSrcTy();     
+                    Type *pointedType = cast<PointerType>(srcType)->getElementType();
+
+                    // 如果pointer原本指向的数据也是一个指针且这个指针的类型是敏感的
+                    if (pointedType->isPointerTy() && 
+                        isSensitiveType(pointedType))
+                    { 
+                        result.insert(value);
+                        result.insert(pointer);
                     }
                 }
             }
+        }
 
-            // // 待修改完SVF后补完
-            // if(LoadInst *L = dyn_cast<LoadInst>(&(*I)))
-            // {
-            //     if(L->getType()->getPointerElementType()->isVoidTy())
-            //     {
+        // // 待修改完SVF后补完
+        // if(LoadInst *L = dyn_cast<LoadInst>(&(*I)))
+        // {
+        //     if(L->getType()->getPointerElementType()->isVoidTy())
+        //     {
 
-            //     }
-            // }
+        //     }
+        // }
+    }
+}
 
-            // 记录所有函数的所有返回值(函数可能有多条返回指令，多个返回值)
-            if (ReturnInst *retInst = dyn_cast<ReturnInst>(&(*I)))
-            { 
-                if (retInst->getNumOperands() > 0)
-                    func2RetValue[&F].push_back(retInst->getOperand(0));
-            }
+void COLLATEPass::collectReturnValues(Function &F)
+{
+    // 记录函数的所有返回值(函数可能有多条返回指令，多个返回值)
+    for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; I++)
+    {
+        if (ReturnInst *retInst = dyn_cast<ReturnInst>(&(*I)))
+        { 
+            if (retInst->getNumOperands() > 0)
+                func2RetValue[&F].push_back(retInst->getOperand(0));
         }
     }
+}
+
+static ArrayRef<Type *> getTypeEdges(Type *Ty)
+{
+    // 类型图中的边：指针 -> 指向的类型，数组/容器 -> 元素类型，结构体 -> 各个成员的类型。
+    // 函数类型、基本类型和只有声明的结构体是图中的汇点
+    if (Ty->isFunctionTy() || Ty->isIntegerTy() || Ty->getTypeID() <= Type::X86_MMXTyID)
+        return ArrayRef<Type *>();
+
+    if (StructType *sTy = dyn_cast<StructType>(Ty))
+        return sTy->isOpaque() ? ArrayRef<Type *>() : sTy->elements();
+
+    if (Ty->isPointerTy() || Ty->isArrayTy() || Ty->isVectorTy())
+        return Ty->subtypes();
 
+    return ArrayRef<Type *>();
 }
 
-bool COLLATEPass::shouldProtectType(Type *Ty, unordered_set<Type *> &Visited, vector<Type *> &Route, MDNode *TBAATag)
+void COLLATEPass::classifyTypes(Module &M)
+{
+    for (auto *S : M.getIdentifiedStructTypes())
+        isSensitiveType(S);
+    for (auto const &G : M.globals())
+        isSensitiveType(G.getType());
+}
+
+bool COLLATEPass::isSensitiveType(Type *Ty)
 {
     auto it = taintSourceTypes.find(Ty);
-    if (it != taintSourceTypes.end() && !TBAATag)
-    {
-        if(it->second)
-            Route.push_back(Ty);
+    if (it != taintSourceTypes.end())
         return it->second;
-    }
 
-    if (Ty->isFunctionTy())
+    classifyTypeSCCs(Ty);
+    return taintSourceTypes.lookup(Ty);
+}
+
+void COLLATEPass::classifyTypeSCCs(Type *Root)
+{
+    // 一个类型是敏感的，当且仅当在类型图上能到达函数类型。
+    // 递归类型(如struct A{struct A* a; ...})在图上形成环，用Tarjan算法求出强连通分量，
+    // 同一个分量中的类型敏感性相同，分量敏感当且仅当其中有函数类型或者它能到达敏感的分量。
+    struct Node
     {
-        taintSourceTypes[Ty] = true;
-        Route.push_back(Ty);
-        return true;
-    }
+        unsigned index;
+        unsigned lowlink;
+        bool sensitive;
+        bool onStack;
+    };
+    DenseMap<Type *, Node> nodes;
+    vector<Type *> sccStack;
+    vector<pair<Type *, unsigned>> dfsStack; // 类型, 下一条要访问的边
+    unsigned counter = 0;
 
-    if (Ty->getTypeID() <= Type::X86_MMXTyID || Ty->isIntegerTy())
+    auto visit = [&](Type *Ty)
     {
-        taintSourceTypes[Ty] = false;
-        return false;
+        Node N = {counter, counter, Ty->isFunctionTy(), true};
+        nodes[Ty] = N;
+        counter++;
+        sccStack.push_back(Ty);
+        dfsStack.push_back(make_pair(Ty, 0));
+    };
+
+    visit(Root);
+    while (!dfsStack.empty())
+    {
+        Type *Ty = dfsStack.back().first;
+        ArrayRef<Type *> edges = getTypeEdges(Ty);
+        if (dfsStack.back().second < edges.size())
+        {
+            Type *succ = edges[dfsStack.back().second++];
+
+            // 之前已经分类过的类型
+            auto done = taintSourceTypes.find(succ);
+            if (done != taintSourceTypes.end())
+            {
+                nodes[Ty].sensitive |= done->second;
+                continue;
+            }
+
+            auto it = nodes.find(succ);
+            if (it == nodes.end())
+                visit(succ);
+            else if (it->second.onStack)
+                nodes[Ty].lowlink = min(nodes[Ty].lowlink, it->second.index);
+            continue;
+        }
+
+        dfsStack.pop_back();
+        Node &N = nodes[Ty];
+        if (N.lowlink == N.index)
+        {
+            // Ty是分量的根，栈中Ty以上的类型都属于这个分量
+            size_t first = sccStack.size();
+            bool sensitive = false;
+            do
+            {
+                first--;
+                sensitive |= nodes[sccStack[first]].sensitive;
+            } while (sccStack[first] != Ty);
+
+            for (size_t i = first; i < sccStack.size(); i++)
+            {
+                nodes[sccStack[i]].onStack = false;
+                taintSourceTypes[sccStack[i]] = sensitive;
+            }
+            sccStack.resize(first);
+        }
+
+        if (!dfsStack.empty())
+        {
+            Node &parent = nodes[dfsStack.back().first];
+            Node &child = nodes[Ty];
+            if (child.onStack)
+            {
+                parent.lowlink = min(parent.lowlink, child.lowlink);
+                parent.sensitive |= child.sensitive;
+            }
+            else
+                parent.sensitive |= taintSourceTypes[Ty];
+        }
     }
+}
+
+bool COLLATEPass::isFuncPtrTag(MDNode *TBAATag)
+{
+    auto it = funcPtrTags.find(TBAATag);
+    if (it != funcPtrTags.end())
+        return it->second;
 
     auto getMDString = [](MDNode *TBAATag)
     {
@@ -381,156 +660,70 @@ bool COLLATEPass::shouldProtectType(Type *Ty, unordered_set<Type *> &Visited, ve
         return TagName;
     };
 
-    // 处理包含在结构体中的i8*指针
-    if (TBAATag && TBAATag->getNumOperands() > 1)
+    bool isFuncPtr = false;
+    if (TBAATag->getNumOperands() > 1)
     {
         MDString *TagName = getMDString(TBAATag);
         if (TagName)
         {
-            if (TagName->getString() == "vtable pointer" ||
-                TagName->getString() == "function pointer")
-            {
-                taintSourceTypes[Ty] = true;
-                Route.push_back(Ty);
-                return true;
-            }
+            isFuncPtr = TagName->getString() == "vtable pointer" ||
+                        TagName->getString() == "function pointer";
         }
     }
+    funcPtrTags[TBAATag] = isFuncPtr;
+    return isFuncPtr;
+}
 
-    // 找到指针最终指向的类型
-    Type *elemType = Ty;
-    while (elemType->isPointerTy())
-    {
-        PointerType *tmpType = dyn_cast<PointerType>(elemType);
-        elemType = tmpType->getElementType(); 
-    }
-
-    // 这是针对递归类型，如：
-    //              struct A{
-    //                  struct A* a;……}
-    if (Visited.find(elemType) != Visited.end())
-    {
-        return false;
-    }
-
-    // 最终指向函数
-    if (elemType->isFunctionTy())
-    {
-        taintSourceTypes[Ty] = true;
-        Route.push_back(Ty);
-        return true;
-    }
-
-    // 最终指向数组
-    if (elemType->isArrayTy())
-    {
-        ArrayType *tmpTy;
-        tmpTy = dyn_cast<ArrayType>(elemType);
-        Visited.insert(tmpTy);
-        // 判断元素的类型是否敏感
-        bool isSensitive = shouldProtectType(tmpTy->getElementType(), Visited, Route, nullptr);
+bool COLLATEPass::isSensitiveType(Type *Ty, MDNode *TBAATag)
+{
+    if (!TBAATag || Ty->isFunctionTy() || Ty->isIntegerTy() || Ty->getTypeID() <= Type::X86_MMXTyID)
+        return isSensitiveType(Ty);
+
+    /*处理包含在结构体中的i8*指针，以及clang由于类型系统的缺陷，
+      将结构体中函数指针的类型设置为{}*的情况，
+      详见https://stackoverflow.com/questions/18730620/ 和
+      https://lists.llvm.org/pipermail/cfe-dev/2016-November/051601.html
+      这些情况下TBAATag仍能正确的将其标识为函数指针。
+      TBAA的结果与类型本身的结果分开缓存，不影响不带TBAATag的查询
+    */
+    return isFuncPtrTag(TBAATag) || isSensitiveType(Ty);
+}
 
-        if (isSensitive)
-        {
-            Route.push_back(Ty);
-            Routes[Ty] = Route;
-        }
-        
-        taintSourceTypes[Ty] = isSensitive;
-        return isSensitive;
-    }
+void COLLATEPass::taintPropagation(Module &M, const TaintSet &source, TaintSet &taintedSet, TaintSet &result)
+{
+    result = source;
 
-    // 最终指向容器
-    if (elemType->isVectorTy())
+    if (CollateTaintEngine == TE_SVFG)
     {
-        VectorType *tmpTy;
-        tmpTy = dyn_cast<VectorType>(elemType);// 转换成容器类型
-        Visited.insert(tmpTy);
-        bool isSensitive = shouldProtectType(tmpTy->getElementType(), Visited, Route);// 判断元素的类型是否敏感
-
-        if (isSensitive)
-        {
-            Route.push_back(Ty);
-            Routes[Ty] = Route;
-        }
-        
-        taintSourceTypes[Ty] = isSensitive;
-        return isSensitive;
+        SVFGTaintEngine engine(svf->getPAG(), svf->getSVFG());
+        engine.propagate(source, taintedSet);
     }
-
-    // 处理结构体、联合体、类
-    if (elemType->isStructTy())
+    else
     {
-        StructType* tmpTy = dyn_cast<StructType>(elemType);
-        
-        // 特殊情况，只声明，没赋值，如：void Bar(struct Foo *);
-        if (tmpTy->isOpaque())
-        {
-            taintSourceTypes[Ty] = false;
-            return false;
-        }
-
-        /*特殊情况，clang由于类型系统的缺陷，在某些情况下会将结构体中函数指针的类型设置为{}*
-          详见https://stackoverflow.com/questions/18730620/ 和
-          https://lists.llvm.org/pipermail/cfe-dev/2016-November/051601.html
-          但这种情况下TBAATag仍能正确的将其标识为函数指针
-        */
-        if (tmpTy->getNumElements() == 0 && TBAATag && TBAATag->getNumOperands() > 1)
-        {
-            MDString *TagName = getMDString(TBAATag);
-            if (TagName && TagName->getString() == "function pointer")
-            {
-                taintSourceTypes[Ty] = true;
-                Route.push_back(Ty);
-                return true;
-            }
-        }
-
-        bool isSensitive = false;
-        Visited.insert(tmpTy);
-
-        for (int i = 0; i < tmpTy->getNumElements(); i++)
-        {
-            auto subTy = tmpTy->getElementType(i);
-            isSensitive = shouldProtectType(subTy, Visited, Route);
-            if(isSensitive)
-                break;
-        }
-        if(isSensitive)
-        {
-            Route.push_back(Ty);
-            Routes[Ty] = Route;
-        }
-
-        taintSourceTypes[Ty] = isSensitive;
-        return isSensitive;
+        // 以污点源为起点，只沿新被污染值的使用者传播，直到工作队列为空
+        TaintWorklist worklist(taintedSet);
+        for (unsigned id : source.ids())
+            worklist.insert(id);
+        propagateTaint(worklist);
     }
 
-    taintSourceTypes[Ty] = false;
-    return false;
+    sliceConstrainingData(taintedSet, result);
 }
 
-void COLLATEPass::taintPropagation(Module &M, unordered_set<Value *> source, unordered_set<Value *> &result)
+void COLLATEPass::propagateTaint(TaintWorklist &worklist)
 {
-    analyzeIndirectCalls(M);
-
-    bool flag = true;
-    unordered_set<Value *> taintedSet = source;
-    result = source;
-    
-    while(flag)
-    {
-        flag = false;
-        for (auto &F : M)
-        {
-            flag |= doInFunction(F, taintedSet);
-        }
-    }
+    if (CollateThreads > 1)
+        propagateParallel(worklist);
+    else
+        propagate(worklist);
+}
 
-    unordered_set<Value *> complement;
-    for (auto it : taintedSet)
+void COLLATEPass::sliceConstrainingData(const TaintSet &taintedSet, TaintSet &result)
+{
+    TaintSet complement(*valueIndex);
+    for (unsigned id : taintedSet.ids())
     {
-        if(Instruction *I = dyn_cast<Instruction>(it))
+        if(Instruction *I = dyn_cast<Instruction>(valueIndex->getValue(id)))
         {
             if(isa<CallInst>(I) || isa<InvokeInst>(I))
                 continue;
@@ -552,7 +745,7 @@ void COLLATEPass::taintPropagation(Module &M, unordered_set<Value *> source, uno
             */
             if(PHINode *PN = dyn_cast<PHINode>(I))
             {
-                DominatorTree DT = DominatorTree(*(PN->getFunction()));
+                DominatorTree &DT = getDomTree(*(PN->getFunction()));
                 DomTreeNodeBase< BasicBlock > *BN = DT.getNode(PN->getParent());
                 BasicBlock *X = BN->getIDom()->getBlock();
 
@@ -573,585 +766,1393 @@ void COLLATEPass::taintPropagation(Module &M, unordered_set<Value *> source, uno
                 }
             }
 
-            int n = I->getNumOperands();
-            for (unsigned i = 0; i < n; ++i)
+            for (unsigned operand : valueIndex->getOperands(id))
             {
-                Value *operand = I->getOperand(i);
-                if (!result.count(operand) && !isa<ConstantData>(operand))
-                    complement.insert(operand);
+                if (!result.test(operand) && !isa<ConstantData>(valueIndex->getValue(operand)))
+                    complement.set(operand);
             }
         }
     }
 
-    map<Function*, vector<Value*>> func2Caller;
-    for(auto it : directCall2Target)
+    /*从complement出发沿操作数反向切片：
+        alloca、call和load是切片的边界，不再继续追溯其操作数；
+        到达形参时转到所有调用点上对应的实参继续追溯。
+      complement同时作为全局的已访问集合，每个值只进入工作队列一次，
+      因此切片的代价与切片的大小成线性关系。
+    */
+    vector<unsigned> worklist;
+    for(unsigned id : complement.ids())
+        worklist.push_back(id);
+
+    auto visit = [&](unsigned op)
     {
-        Value *cs = it.getFirst(); // call/invoke指令
-        Function *f = it.getSecond(); //调用的函数
-        auto fc = func2Caller.find(f);
-        if(fc == func2Caller.end())
-        {
-            vector<Value*> tmp;
-            tmp.push_back(cs);
-            func2Caller[f] = tmp;
-        }
-        else
-            (fc->second).push_back(cs);
-    }
+        if(!isa<ConstantData>(valueIndex->getValue(op)) && complement.set(op))
+            worklist.push_back(op);
+    };
 
-    for(auto it : indirectCall2Target)
+    while(!worklist.empty())
     {
-        for(auto user : (it.getFirst())->users())
+        unsigned id = worklist.back();
+        worklist.pop_back();
+
+        Value *v = valueIndex->getValue(id);
+        if(Instruction *I = dyn_cast<Instruction>(v))
         {
-            if(isa<CallInst>(user) || isa<InvokeInst>(user))
+            if(!isa<AllocaInst>(I) && !isa<CallInst>(I) && !isa<LoadInst>(I))
             {
-                Value *cs = user;
-                unordered_set<Function*> funcs = it.getSecond();
-                for(auto f : funcs)
-                {
-                    auto fc = func2Caller.find(f);
-                    if(fc == func2Caller.end())
-                    {
-                        vector<Value*> tmp;
-                        tmp.push_back(cs);
-                        func2Caller[f] = tmp;
-                    }
-                    else
-                        (fc->second).push_back(cs);
-                }
+                for(unsigned op : valueIndex->getOperands(id))
+                    visit(op);
             }
         }
-    }
-
-    auto backTrace = [](unordered_set<Value *> &tmp)
-    {
-        queue<Value *> q;
-        for(auto it : tmp)
-            q.push(it);
-        while(!q.empty())
+        else if(Argument *param = dyn_cast<Argument>(v))
         {
-            auto v = q.front();
-            q.pop();
-            if(Instruction *I = dyn_cast<Instruction>(v))
+            // 形参对应每个调用点上相同位置的实参(调用指令的第argNo个操作数)，经bitcast调用时实参可能不足
+            unsigned argNo = param->getArgNo();
+            for(CallBase *CB : callGraph.getCallSites(param->getParent()))
             {
-                if(!isa<AllocaInst>(I) && !isa<CallInst>(I) && !isa<LoadInst>(I))
-                {
-                    int n = I->getNumOperands();
-                    for (int i = 0; i < n; i++)
-                    {
-                        Value *op = I->getOperand(i);
-                        if(!tmp.count(op) && !isa<ConstantData>(op)) 
-                        {
-                            q.push(op);
-                            tmp.insert(op);
-                        }
-                    }
-                }
+                if(argNo < CB->arg_size())
+                    visit(valueIndex->getOperands(valueIndex->lookup(CB))[argNo]);
             }
         }
-    };
+    }
 
-    vector<Argument*> params; // 形参
-    unordered_set<Argument*> checkedParams; 
-    vector<Value*> args; // 形参对应的实参
+    result |= complement;
+}
 
-    while(true)
+void COLLATEPass::propagate(TaintWorklist &taintValues)
+{
+    double start = TimeRecord::getCurrentTime().getWallTime();
+    uint64_t visited = 0;
+    auto visit = [&](unsigned I)
     {
-        args.clear();
-        params.clear();
-        backTrace(complement);
-        for(auto it : complement)
-        {
-            result.insert(it);
-            if(Argument *param = dyn_cast<Argument>(it))
-            {
-                if(!checkedParams.count(param))
-                {
-                    args.push_back(param);
-                    checkedParams.insert(param);
-                }
-            }
-        }
+        visited++;
+        doInInstruction(I, taintValues);
+    };
 
-        for(auto param : params)
+    while (!taintValues.empty())
+    {
+        if (taintValues.hasPendingInst())
         {
-            Function *f = param->getParent();
-            vector<Value*> callSites = func2Caller[param->getParent()];
-            for(auto cs : callSites)
-            {
-                CallBase *CB = dyn_cast<CallBase>(cs);
-                auto fit = f->arg_begin(); // 形参
-                auto ait = CB->arg_begin(); // 实参
-                // 查找形参param对应的实参arg
-                while (fit != f->arg_end() && ait != CB->arg_end())
-                {
-                    Argument *formal = dyn_cast<Argument>(&(*pit));
-                    Value *actual = *ait;
-                    if(formal == param)
-                        break; 
-                    ++fit;
-                    ++ait;
-                }
-                args.push_back(*ait);
-            }
+            visit(taintValues.popInst());
+            continue;
         }
 
-        if(args.empty())
-            break;
-        
-        complement.clear();
-        for(auto it : args)
-            complement.insert(it);
+        // 只有以新污点值为操作数(或就是该值本身)的指令的规则可能产生新的污点
+        unsigned id = taintValues.popValue();
+        Value *V = valueIndex->getValue(id);
+        if (isa<Instruction>(V))
+            visit(id);
+
+        for (unsigned user : valueIndex->getUsers(id))
+            visit(user);
+
+        // 形参被污染后，需要把污点传给所有调用点对应的实参
+        if (Argument *A = dyn_cast<Argument>(V))
+            handleCallsites(A->getParent(), taintValues);
     }
+
+    // 串行传播只有一轮
+    NumPropagationRounds++;
+    stats.addRound(TimeRecord::getCurrentTime().getWallTime() - start, visited);
 }
 
-bool COLLATEPass::doInFunction(Function &F, unordered_set<Value *> &taintValues)
+bool COLLATEPass::isInterprocedural(Instruction *I)
 {
-    auto addIfOneIsSensitive = [&taintValues](Value *V1, Value *V2)
-    {
-        if(taintValues.find(V1) != taintValues.end())
-            return taintValues.insert(V2).second;
-        else if(taintValues.find(V2) != taintValues.end())
-            return taintValues.insert(V1).second;
-        else
-            return false;
-    };
+    // 这些指令的规则会读写其他函数的值以及tiantReturnFuncs/tiantVarArgs，只能在主线程中执行
+    return isa<CallInst>(I) || isa<InvokeInst>(I) || isa<ReturnInst>(I);
+}
 
-    auto addSecondIfFirstIsSensitive = [&taintValues](Value *V1, Value *V2)
-    {
-        if(taintValues.find(V1) != taintValues.end())
-            return taintValues.insert(V2).second;
-        else
-            return false;
-    };
+void COLLATEPass::propagateInFunction(ArrayRef<unsigned> insts, TaintWorklist &localValues)
+{
+    // 每个线程复用一个位向量记录本地增量，不必为每个函数分配和清零
+    static thread_local BitVector localBits;
+    if (localBits.size() < valueIndex->size())
+        localBits.resize(valueIndex->size());
+    localValues.bindLocalBits(&localBits);
 
-    auto addValueIfReturnIsSensitive = [&](Value *V, Function *F)
+    for (unsigned I : insts)
+        doInInstruction(I, localValues);
+
+    while (!localValues.empty())
     {
-        if (F->getReturnType()->isPointerTy())
-        {
-            if (tiantReturnFuncs.count(F))
-                return taintValues.insert(V).second;
-        }
-        return false;
+        // 只继续传播本函数的值(指令和形参)，它们的使用者都在本函数中；
+        // 全局变量、常量等的使用者以及跨函数的规则留给主线程合并时处理
+        unsigned id = localValues.popValue();
+        Value *V = valueIndex->getValue(id);
+        if (!isa<Instruction>(V) && !isa<Argument>(V))
+            continue;
+
+        if (Instruction *I = dyn_cast<Instruction>(V))
+            if (!isInterprocedural(I))
+                doInInstruction(id, localValues);
+
+        for (unsigned user : valueIndex->getUsers(id))
+            if (!isInterprocedural(cast<Instruction>(valueIndex->getValue(user))))
+                doInInstruction(user, localValues);
+    }
+
+    localValues.unbindLocalBits();
+}
+
+void COLLATEPass::propagateParallel(TaintWorklist &taintValues)
+{
+    ThreadPool pool(hardware_concurrency(CollateThreads));
+    MapVector<Function *, vector<unsigned>> dirty;
+    uint64_t visited = 0;
+
+    // 跨函数的规则在主线程中立即执行，函数内的规则按函数分组留给并行阶段
+    auto schedule = [&](unsigned id)
+    {
+        visited++;
+        Instruction *I = cast<Instruction>(valueIndex->getValue(id));
+        if (isInterprocedural(I))
+            doInInstruction(id, taintValues);
+        else
+            dirty[I->getFunction()].push_back(id);
     };
 
-    bool ret = false;
-    for (inst_iterator ii = inst_begin(F), ie = inst_end(F);
-         ii != ie; ++ii)
+    while (true)
     {
-        Instruction *inst = &(*ii);
-        if (BitCastInst *bcInst = dyn_cast<BitCastInst>(inst))
-        {
-            ret |= addIfOneIsSensitive(bcInst, bcInst->getOperand(0));
-        }
-        else if (LoadInst *lInst = dyn_cast<LoadInst>(inst))
+        double start = TimeRecord::getCurrentTime().getWallTime();
+        visited = 0;
+
+        // 串行阶段：处理新污点的使用者、调用点和返回值
+        while (!taintValues.empty())
         {
-            ret |= addSecondIfFirstIsSensitive(lInst, lInst->getPointerOperand());
-        }
-        else if (StoreInst *sInst = dyn_cast<StoreInst>(inst))
-        { 
-            bool tmpR = addSecondIfFirstIsSensitive(sInst->getValueOperand(), sInst->getPointerOperand());
-            ret |= tmpR;
-            tmpR = addSecondIfFirstIsSensitive(sInst->getPointerOperand(), sInst->getValueOperand());
-            ret |= tmpR;
-            if (taintValues.find(sInst->getValueOperand()) != taintValues.end() || taintValues.find(sInst->getPointerOperand()) != taintValues.end()) 
-                ret |= taintValues.insert(sInst).second;
-        }
-        else if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(inst))
-        {   
-            // 如果发现这条getelementptr是用于获取敏感的va_list内元素的地址，那么它是敏感值
-            ret |= addSecondIfFirstIsSensitive(gepInst, gepInst->getPointerOperand());
-            Value *pOperand = gepInst->getPointerOperand();
-            Type *OTy = pOperand->getType();
-            if (OTy->isVectorTy())
-                OTy = dyn_cast<VectorType>(OTy)->getElementType();
-                
-            Type *pTy = (cast<PointerType>(OTy))->getElementType(); 
-            if (StructType *sTy = dyn_cast<StructType>(pTy))
+            if (taintValues.hasPendingInst())
             {
-                if (sTy->hasName() && sTy->getName() == "struct.__va_list_tag" && tiantVarArgs.count(&F))
-                    if (gepInst->getType()->isPointerTy())
-                    {
-                        PointerType *pTy = cast<PointerType>(gepInst->getType());
-                        if (pTy->getElementType()->isIntegerTy(8))
-                            ret = taintValues.insert(gepInst).second;
-                    }
+                schedule(taintValues.popInst());
+                continue;
             }
+
+            unsigned id = taintValues.popValue();
+            Value *V = valueIndex->getValue(id);
+            if (isa<Instruction>(V))
+                schedule(id);
+
+            for (unsigned user : valueIndex->getUsers(id))
+                schedule(user);
+
+            if (Argument *A = dyn_cast<Argument>(V))
+                handleCallsites(A->getParent(), taintValues);
         }
-        else if (CallInst *cInst = dyn_cast<CallInst>(inst))
+
+        if (dirty.empty())
         {
-            Function *f = cInst->getCalledFunction();
-            CallBase *CB = dyn_cast<CallBase>(cInst);
-            if (f)
-            {
-                // 处理直接调用，跨函数传播
-                ret |= handleCallsite(CB, f, taintValues);//进行污点传播
-                ret |= addValueIfReturnIsSensitive(inst, f);
-                /*
-                if (func2RetValue.find(f) != func2RetValue.end()) {
-                    ret |= addSecondIfFirstIsSensitive(cInst, func2RetValue[f]);
-                }
-                */
-            }
-            else
+            stats.addRound(TimeRecord::getCurrentTime().getWallTime() - start, visited);
+            NumPropagationRounds++;
+            break;
+        }
+
+        // 并行阶段：每个函数在只读的共享集合上做函数内传播，产生各自的增量
+        auto work = dirty.takeVector();
+        vector<unique_ptr<TaintWorklist>> deltas;
+        for (unsigned i = 0; i < work.size(); i++)
+            deltas.emplace_back(new TaintWorklist(taintValues.getSet()));
+
+        for (unsigned i = 0; i < work.size(); i++)
+            pool.async([this, &work, &deltas, i]() { propagateInFunction(work[i].second, *deltas[i]); });
+        pool.wait();
+
+        // 同步点：按函数顺序合并增量，结果与线程数无关
+        for (auto &delta : deltas)
+        {
+            for (unsigned id : delta->getDelta())
             {
-                // 处理间接调用，跨函数传播
-                auto &targets = indirectCall2Target[cInst->getCalledOperand()];
-                for (Function *target : targets)
+                Value *V = valueIndex->getValue(id);
+                if (!isa<Instruction>(V) && !isa<Argument>(V))
                 {
-                    ret |= handleCallsite(CB, target, taintValues);
-                    ret |= addValueIfReturnIsSensitive(inst, target);
-                    /*
-                    if (func2RetValue.find(target) != func2RetValue.end()) {
-                        ret |= addSecondIfFirstIsSensitive(cInst, func2RetValue[target]);
-                    }
-                    */
+                    taintValues.insert(id);
+                    continue;
                 }
+
+                // 函数内的使用者已经在并行阶段处理过，只需补上跨函数的部分
+                if (!taintValues.insertQuiet(id))
+                    continue;
+
+                for (unsigned user : valueIndex->getUsers(id))
+                    if (isInterprocedural(cast<Instruction>(valueIndex->getValue(user))))
+                        taintValues.revisit(user);
+
+                if (Argument *A = dyn_cast<Argument>(V))
+                    handleCallsites(A->getParent(), taintValues);
             }
         }
-        else if (InvokeInst *iInst = dyn_cast<InvokeInst>(inst))
+
+        // 一轮：串行阶段、并行阶段和同步点
+        stats.addRound(TimeRecord::getCurrentTime().getWallTime() - start, visited);
+        NumPropagationRounds++;
+    }
+}
+
+DominatorTree &COLLATEPass::getDomTree(Function &F)
+{
+    // 同一个函数中可能有大量敏感的phi node，分析期间不修改CFG，支配树可以复用
+    unique_ptr<DominatorTree> &DT = domTrees[&F];
+    if (!DT)
+        DT.reset(new DominatorTree(F));
+    return *DT;
+}
+
+bool COLLATEPass::doInInstruction(unsigned id, TaintWorklist &taintValues)
+{
+    // 规则按编号测试操作数：ops[i]是第i个操作数的编号
+    Instruction *inst = cast<Instruction>(valueIndex->getValue(id));
+    ArrayRef<unsigned> ops = valueIndex->getOperands(id);
+
+    auto addIfOneIsSensitive = [&taintValues](unsigned V1, unsigned V2)
+    {
+        if(taintValues.count(V1))
+            return taintValues.insert(V2);
+        else if(taintValues.count(V2))
+            return taintValues.insert(V1);
+        else
+            return false;
+    };
+
+    auto addSecondIfFirstIsSensitive = [&taintValues](unsigned V1, unsigned V2)
+    {
+        if(taintValues.count(V1))
+            return taintValues.insert(V2);
+        else
+            return false;
+    };
+
+    auto addValueIfReturnIsSensitive = [&](Function *F)
+    {
+        if (F->getReturnType()->isPointerTy())
+        {
+            if (tiantReturnFuncs.count(F))
+                return taintValues.insert(id);
+        }
+        return false;
+    };
+
+    // 直接调用的被调函数是调用指令的最后一个操作数，间接调用的目标按值查编号
+    auto handleCall = [&](CallBase *CB)
+    {
+        bool ret = false;
+        if (Function *f = CB->getCalledFunction())
+        {
+            ret |= handleCallsite(id, ops.back(), taintValues);
+            ret |= addValueIfReturnIsSensitive(f);
+        }
+        else
         {
-            // 处理invoke指令，和call一样
-            Function *f = iInst->getCalledFunction();
-            CallBase *CB = dyn_cast<CallBase>(iInst);
-            if (f)
+            const CallTargets *targets = indirectCall2Target.lookup(CB->getCalledOperand());
+            for (Function *target : *targets)
             {
-                ret |= handleCallsite(CB, f, taintValues);
-                ret |= addValueIfReturnIsSensitive(inst, f);
-                /*
-                if (func2RetValue.find(f) != func2RetValue.end()) {
-                    ret |= addSecondIfFirstIsSensitive(iInst, func2RetValue[f]);
-                }
-                */
+                ret |= handleCallsite(id, valueIndex->lookup(target), taintValues);
+                ret |= addValueIfReturnIsSensitive(target);
             }
-            else
-            {
-                std::unordered_set<Function *> &targets = indirectCall2Target[iInst->getCalledOperand()];
-                for (Function *target : targets)
+        }
+        return ret;
+    };
+
+    bool ret = false;
+    Function &F = *inst->getFunction();
+    if (isa<BitCastInst>(inst))
+    {
+        ret |= addIfOneIsSensitive(id, ops[0]);
+    }
+    else if (isa<LoadInst>(inst))
+    {
+        ret |= addSecondIfFirstIsSensitive(id, ops[0]);
+    }
+    else if (isa<StoreInst>(inst))
+    { 
+        // 操作数依次为值和指针
+        bool tmpR = addSecondIfFirstIsSensitive(ops[0], ops[1]);
+        ret |= tmpR;
+        tmpR = addSecondIfFirstIsSensitive(ops[1], ops[0]);
+        ret |= tmpR;
+        if (taintValues.count(ops[0]) || taintValues.count(ops[1])) 
+            ret |= taintValues.insert(id);
+    }
+    else if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(inst))
+    {   
+        // 如果发现这条getelementptr是用于获取敏感的va_list内元素的地址，那么它是敏感值
+        ret |= addSecondIfFirstIsSensitive(id, ops[0]);
+        Value *pOperand = gepInst->getPointerOperand();
+        Type *OTy = pOperand->getType();
+        if (OTy->isVectorTy())
+            OTy = dyn_cast<VectorType>(OTy)->getElementType();
+            
+        Type *pTy = (cast<PointerType>(OTy))->getElementType(); 
+        if (StructType *sTy = dyn_cast<StructType>(pTy))
+        {
+            if (sTy->hasName() && sTy->getName() == "struct.__va_list_tag" && tiantVarArgs.count(&F))
+                if (gepInst->getType()->isPointerTy())
                 {
-                    ret |= handleCallsite(CB, target, taintValues);
-                    ret |= addValueIfReturnIsSensitive(inst, target);
-                    /*
-                    if (func2RetValue.find(target) != func2RetValue.end()) {
-                        ret |= addSecondIfFirstIsSensitive(iInst, func2RetValue[target]);
-                    }
-                    */
+                    PointerType *pTy = cast<PointerType>(gepInst->getType());
+                    if (pTy->getElementType()->isIntegerTy(8))
+                        ret = taintValues.insert(id);
                 }
-            }
         }
-        else if (ReturnInst *rInst = dyn_cast<ReturnInst>(inst))
+    }
+    else if (CallInst *cInst = dyn_cast<CallInst>(inst))
+    {
+        // 处理直接和间接调用，跨函数传播
+        ret |= handleCall(cInst);
+    }
+    else if (InvokeInst *iInst = dyn_cast<InvokeInst>(inst))
+    {
+        // 处理invoke指令，和call一样
+        ret |= handleCall(iInst);
+    }
+    else if (ReturnInst *rInst = dyn_cast<ReturnInst>(inst))
+    {
+        // 处理return指令，跨函数传播
+        if (!ops.empty() && taintValues.count(ops[0]))
         {
-            // 处理return指令，跨函数传播
-            Value *retValue = rInst->getReturnValue();
-            if (retValue && taintValues.count(retValue))
+            Function *f = rInst->getParent()->getParent();
+            // 记录函数有敏感的返回值，并重新检查调用它的指令
+            if (tiantReturnFuncs.insert(f).second)
             {
-                Function *f = rInst->getParent()->getParent();
-                tiantReturnFuncs.insert(f);// 记录函数有敏感的返回值
-                if (func2RetValue.find(f) != func2RetValue.end())// 函数可能有多个返回指令多个返回值，只要有一个是敏感的，那全都设为敏感值
-                    for (auto value : func2RetValue[f])
-                        ret |= taintValues.insert(value).second;
-                ret |= taintValues.insert(rInst).second;
+                for (CallBase *CB : callGraph.getCallSites(f))
+                    taintValues.revisit(CB);
             }
+            if (func2RetValue.find(f) != func2RetValue.end())// 函数可能有多个返回指令多个返回值，只要有一个是敏感的，那全都设为敏感值
+                for (auto value : func2RetValue[f])
+                    ret |= taintValues.insert(value);
+            ret |= taintValues.insert(id);
         }
-        else if (PHINode *pNode = dyn_cast<PHINode>(inst))
+    }
+    else if (PHINode *pNode = dyn_cast<PHINode>(inst))
+    {
+        // phi的操作数就是各个传入的值
+        // 如果传给phinode的值是敏感值，那么phinode也设为敏感值
+        for (unsigned i = 0; i < pNode->getNumIncomingValues(); ++i)
+            ret |= addSecondIfFirstIsSensitive(ops[i], id);
+        // 如果phinode是敏感值，那么传给phinode的值都设为敏感值
+        for (unsigned i = 0; i < pNode->getNumIncomingValues(); ++i)
+            ret |= addSecondIfFirstIsSensitive(id, ops[i]);
+    }
+    else if (isa<SelectInst>(inst))
+    {
+        // 操作数依次为条件、真值和假值
+        ret |= addSecondIfFirstIsSensitive(id, ops[1]);
+        ret |= addSecondIfFirstIsSensitive(id, ops[2]);
+    }
+    
+    else if (isa<ExtractElementInst>(inst))
+    {
+        ret |= addSecondIfFirstIsSensitive(id, ops[0]);
+    }
+    else if (isa<ExtractValueInst>(inst))
+    {
+        ret |= addSecondIfFirstIsSensitive(id, ops[0]);
+    }
+
+    else if (isa<InsertElementInst>(inst) || isa<InsertValueInst>(inst))
+    {
+        // 操作数依次为被插入的聚合值(或向量)和插入的值
+        ret |= addSecondIfFirstIsSensitive(ops[1], ops[0]);
+        ret |= addSecondIfFirstIsSensitive(ops[1], id);
+    }
+    return ret;
+}
+
+bool COLLATEPass::handleCallsite(unsigned CS, unsigned F, TaintWorklist &taintValues)
+{
+    bool ret = false;
+    CallBase *CB = cast<CallBase>(valueIndex->getValue(CS));
+    Function *callee = cast<Function>(valueIndex->getValue(F));
+    ArrayRef<unsigned> formals = valueIndex->getOperands(F);          // 形参
+    ArrayRef<unsigned> actuals = valueIndex->getOperands(CS).take_front(CB->arg_size()); // 实参
+
+    // 函数的类别在分析开始前由funcModel确定，这里只查表
+    switch (funcModel.getKind(callee))
+    {
+    case FunctionModel::Ignored:
+    case FunctionModel::Intrinsic:
+        return false;
+
+    case FunctionModel::ArgPropagator:
+    {
+        if (actuals.size() < 2)
+            return false;
+
+        if(taintValues.count(actuals[0]))
         {
-            // 如果传给phinode的值是敏感值，那么phinode也设为敏感值
-            for (unsigned i = 0; i < pNode->getNumIncomingValues(); ++i)
-            {
-                Value *incomingV = pNode->getIncomingValue(i);
-                ret |= addSecondIfFirstIsSensitive(incomingV, pNode);
-            }
-            // 如果phinode是敏感值，那么传给phinode的值都设为敏感值
-            for (unsigned i = 0; i < pNode->getNumIncomingValues(); ++i)
-            {
-                Value *incomingV = pNode->getIncomingValue(i);
-                ret |= addSecondIfFirstIsSensitive(pNode, incomingV);
-            }
+            taintValues.insert(actuals[1]);
+            return true;
         }
-        else if (SelectInst *SI = dyn_cast<SelectInst>(inst))
+        else if(taintValues.count(actuals[1]))
         {
-            Value *TrueValue = SI->getTrueValue();
-            Value *FalseValue = SI->getFalseValue();
-            ret |= addSecondIfFirstIsSensitive(SI, TrueValue);
-            ret |= addSecondIfFirstIsSensitive(SI, FalseValue);
+            taintValues.insert(actuals[0]);
+            return true;
         }
-        
-        else if (ExtractElementInst *EEI = dyn_cast<ExtractElementInst>(inst))
+        else
+            return false;
+    }
+
+    case FunctionModel::Normal:
+        break;
+    }
+
+    // 如果形参和对应实参有一个是敏感值，那么将另一个也设为敏感值
+    unsigned n = std::min(formals.size(), actuals.size());
+    for (unsigned i = 0; i < n; i++)
+    {
+        if(taintValues.count(formals[i]))
+            ret |= taintValues.insert(actuals[i]);
+        else if(taintValues.count(actuals[i]))
+            ret |= taintValues.insert(formals[i]);
+    }
+
+    // 实参比形参多，说明使用了可变参数列表(va_list)来传参
+    for (unsigned i = n; i < actuals.size(); i++)
+    {
+        // F的va_list变为敏感时，需要重新检查F中取va_list元素地址的getelementptr
+        if (taintValues.count(actuals[i]) && tiantVarArgs.insert(callee).second)
         {
-            Value *vectorOperand = EEI->getVectorOperand();
-            ret |= addSecondIfFirstIsSensitive(EEI, vectorOperand);
+            for (inst_iterator ii = inst_begin(callee), ie = inst_end(callee); ii != ie; ++ii)
+                if (isa<GetElementPtrInst>(*ii))
+                    taintValues.revisit(&(*ii));
         }
-        else if (ExtractValueInst *EVI = dyn_cast<ExtractValueInst>(inst))
+    }
+
+    return ret;
+}
+
+void COLLATEPass::handleCallsites(Function *F, TaintWorklist &taintValues)
+{
+    unsigned id = valueIndex->lookup(F);
+    for (CallBase *CB : callGraph.getCallSites(F))
+        handleCallsite(valueIndex->lookup(CB), id, taintValues);
+}
+
+void COLLATEPass::dumpCrData(Module &M, TaintSet &content)
+{
+    // 默认与原来一样写到标准错误，但经过缓冲
+    unique_ptr<raw_fd_ostream> file;
+    raw_fd_ostream stderrOS(STDERR_FILENO, /*shouldClose=*/false, /*unbuffered=*/false);
+    raw_ostream *OS = &stderrOS;
+    if (!CollateReport.empty())
+    {
+        error_code EC;
+        file.reset(new raw_fd_ostream(CollateReport, EC, sys::fs::OF_None));
+        if (EC)
         {
-            Value *aggregateOperand = EVI->getAggregateOperand();
-            ret |= addSecondIfFirstIsSensitive(EVI, aggregateOperand);
+            errs() << "COLLATE: cannot open report " << CollateReport << ": " << EC.message() << "\n";
+            return;
         }
+        OS = file.get();
+    }
+
+    ReportWriter report(*OS, CollateReportFormat, M);
+    for(auto it : content)
+    {
+        if(Instruction *I = dyn_cast<Instruction>(it))
+            report.addInstruction(I);
+        else if (GlobalVariable *G = dyn_cast<GlobalVariable>(it))
+            report.addGlobal(G);
+    }
+}
+
+void COLLATEPass::runPointerAnalysis(Module &M, TaintSet &crData)
+{
+    SVFModule *svfModule = svf->getSVFModule();
+    ddaClient.reset(new CollateDDAClient(svfModule));
+    ddaClient->initialise(svfModule);
+
+    // 只有被污染的load/store访问的内存需要保护，其他指针不发起查询
+    for (auto it : crData)
+    {
+        if (LoadInst *lI = dyn_cast<LoadInst>(it))
+            ddaClient->addQuery(lI->getPointerOperand());
+        else if (StoreInst *sI = dyn_cast<StoreInst>(it))
+            ddaClient->addQuery(sI->getPointerOperand());
+    }
+
+    // 全程序分析一次算出所有指针的指向集，直接取查询的结果
+    if (CollatePTA == PTA_Andersen)
+    {
+        pta = svf->getAndersen();
+        ddaClient->collectResults(pta);
+        return;
+    }
+    if (CollatePTA == PTA_FlowSensitive)
+    {
+        pta = svf->getFlowSensitive();
+        ddaClient->collectResults(pta);
+        return;
+    }
+    
+    ContextCond::setMaxPathLen(CollatePTAMaxPathLen);
+    ContextCond::setMaxCxtLen(CollatePTAMaxCxtLen);
+    if (CollatePTAStepBudget)
+        DPItem::setMaxBudget(CollatePTAStepBudget);
+
+    pta = svf->createContextDDA(ddaClient.get());
+
+    // ContextDDA在initialize中已经构建了Andersen的结果(单例)，用作超出预算时的退路
+    if (CollatePTATimeBudget > 0)
+        ddaClient->setTimeBudget(CollatePTATimeBudget, svf->getAndersen());
+
+    ddaClient->answerQueries(pta);
+    ddaClient->collectResults(pta);
+    pta->finalize();
+
+    if (ddaClient->getNumFallbacks())
+        errs() << "COLLATE: pointer analysis time budget exhausted, " << ddaClient->getNumFallbacks()
+               << " of " << ddaClient->getNumQueries() << " queries use Andersen results\n";
+}
 
-        else if (InsertElementInst *IEI = dyn_cast<InsertElementInst>(inst))
+string COLLATEPass::getOptionsFingerprint()
+{
+    // 影响分析结果的选项，作为缓存键的一部分
+    string fingerprint;
+    raw_string_ostream OS(fingerprint);
+    OS << "taint=" << (unsigned)CollateTaintEngine << ";model=" << funcModel.getFingerprint()
+       << ";pta=" << (unsigned)CollatePTA;
+    if (CollatePTA == PTA_ContextDDA)
+        OS << ";path=" << CollatePTAMaxPathLen << ";cxt=" << CollatePTAMaxCxtLen
+           << ";steps=" << CollatePTAStepBudget << ";time=" << CollatePTATimeBudget;
+    return OS.str();
+}
+
+void COLLATEPass::getMemOfCrData(TaintSet &values, TaintSet &mems)
+{
+    for(auto it : values)
+    {
+        if(LoadInst *lI = dyn_cast<LoadInst>(it))
         {
-            Value *vectorOperand = IEI->getOperand(0);
-            Value *valueOperand = IEI->getOperand(1);
-            ret |= addSecondIfFirstIsSensitive(valueOperand, vectorOperand);
-            ret |= addSecondIfFirstIsSensitive(valueOperand, IEI);
+            for(Value *t : ddaClient->getPointsTo(lI->getPointerOperand()))
+                mems.insert(t);
         }
-
-        else if (InsertValueInst *IVI = dyn_cast<InsertValueInst>(inst))
+        else if(StoreInst *sI = dyn_cast<StoreInst>(it))
+        {
+            for(Value *t : ddaClient->getPointsTo(sI->getPointerOperand()))
+                mems.insert(t);
+        }
+        else if(AllocaInst *aI = dyn_cast<AllocaInst>(it))
         {
-            Value *baseOperand = IVI->getOperand(0);
-            Value *valueOperand = IVI->getOperand(1);
-            ret |= addSecondIfFirstIsSensitive(valueOperand, baseOperand);
-            ret |= addSecondIfFirstIsSensitive(valueOperand, IVI);
+            mems.insert(aI);
+        }
+        else if(GlobalVariable *gV = dyn_cast<GlobalVariable>(it))
+        {
+            mems.insert(gV);
         }
     }
-    return ret;
 }
 
-bool COLLATEPass::handleCallsite(CallBase *CS, Function *F, unordered_set<Value *> &taintValues)
+// 按指针实参访问内存的调用：memcpy/memset等内存操作以及ArgPropagator库函数
+bool COLLATEPass::isMemCall(CallBase *CB)
 {
-    bool ret = false;
-    auto fItr = F->arg_begin();// 形参
-    auto aItr = CS->arg_begin();// 实参
-
-    // 忽略IgnoreFuncs中的函数
-    const char *ignoreFuncs[] = {
-    // c functions
-    "__cxa_atexit", "realloc", "free", "obstack_free",
-    "printf", "sprintf", "vsprintf", "fprintf", "vfprintf",
-    "read", "puts", "scanf", "fread", "fgets", "fputs", "fwrite", 
-    "sscanf", "memchr", "memcmp", "strlen", "strchr", "strtoul", 
-    "strcmp", "strncmp", "strcpy", "strncpy", "strrchr", "strcat",
-    "strtol", "strpbrk", "strstr", "strcspn", "strspn", "strerror", 
-    "strtok", "strtod", "bsearch", "remove", "getenv",
-    // c++ functions
-    "_ZdlPv", "_ZdaPv", "__cxa_begin_catch", "_ZSt20__throw_length_errorPKc", 
-    "__cxa_free_exception", "_cxa_throw", "__dynamic_cast", nullptr};
-    const char *fn = F->getName().data();
-    for (unsigned i = 0; ignoreFuncs[i] != nullptr; ++i)
-    {
-        if (strcmp(ignoreFuncs[i], fn) == 0)
-        {
+    if (isa<MemIntrinsic>(CB))
+        return true;
+    Function *callee = CB->getCalledFunction();
+    return callee && funcModel.getKind(callee) == FunctionModel::ArgPropagator;
+}
+
+void COLLATEPass::getAccessorsOfMems(Module &M, TaintSet &mems, TaintSet &accessors)
+{
+    // 受保护的是整个对象：只有被污染的访问带开关时，同一对象上其他字段的访问会触发段错误。
+    // 每条访问内存的指令和内存操作调用都查询一次指针的指向集，可能指向受保护对象的同样是trusted指令。
+    // 按需分析只回答了被污染的load/store的查询，这里使用全程序的结果(cxt-dda时为它内部的Andersen)
+    PointerAnalysis *wpa = CollatePTA == PTA_ContextDDA ? svf->getAndersen() : pta;
+    SVFIR *pag = wpa->getPAG();
+
+    // 指向同一个PAG节点的指针共享结果
+    DenseMap<NodeID, bool> nodeResults;
+    auto mayAccess = [&](const Value *ptr)
+    {
+        if (!pag->hasValueNode(ptr))
             return false;
+        NodeID id = pag->getValueNode(ptr);
+        auto res = nodeResults.insert(make_pair(id, false));
+        if (!res.second)
+            return res.first->second;
+
+        const PointsTo &pts = wpa->getPts(id);
+        for (PointsTo::iterator ii = pts.begin(), ie = pts.end(); ii != ie; ii++)
+        {
+            PAGNode *targetObj = pag->getGNode(*ii);
+            if (targetObj && !isa<DummyValVar>(targetObj) && !isa<DummyObjVar>(targetObj) &&
+                targetObj->hasValue() && mems.count(targetObj->getValue()))
+            {
+                res.first->second = true;
+                break;
+            }
         }
-    }
+        return res.first->second;
+    };
 
-    const char *propagateArgFuncs[] = {"memcpy", "llvm.memcpy", nullptr};
-    for (unsigned i = 0; propagateArgFuncs[i] != nullptr; i++)
+    for (auto &F : M)
     {
-        unsigned fnLen = strlen(propagateArgFuncs[i]);
-        if (strncmp(propagateArgFuncs[i], fn, fnLen) == 0)
+        for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
         {
-            Value *first = *aItr++;
-            Value *second = *aItr;
-
-            if(taintValues.find(first) != taintValues.end())
+            Instruction *I = &(*ii);
+            Value *ptr = nullptr;
+            if (LoadInst *lI = dyn_cast<LoadInst>(I))
+                ptr = lI->getPointerOperand();
+            else if (StoreInst *sI = dyn_cast<StoreInst>(I))
+                ptr = sI->getPointerOperand();
+            else if (AtomicRMWInst *rI = dyn_cast<AtomicRMWInst>(I))
+                ptr = rI->getPointerOperand();
+            else if (AtomicCmpXchgInst *xI = dyn_cast<AtomicCmpXchgInst>(I))
+                ptr = xI->getPointerOperand();
+
+            if (ptr)
             {
-                taintValues.insert(second);
-                return true;
+                if (mayAccess(ptr))
+                    accessors.insert(I);
+                continue;
             }
-            else if(taintValues.find(second) != taintValues.end())
+
+            CallBase *CB = dyn_cast<CallBase>(I);
+            if (!CB || !isMemCall(CB))
+                continue;
+            for (Use &U : CB->args())
             {
-                taintValues.insert(first);
-                return true;
+                if (U->getType()->isPointerTy() && mayAccess(U))
+                {
+                    accessors.insert(I);
+                    break;
+                }
             }
-            else
-                return false;
         }
     }
+}
 
-    if (F->isIntrinsic())
-        return false;
+void COLLATEPass::collectTrustedInstructions(TaintSet &crData, TaintSet &accessors, TaintSet &trusted)
+{
+    // 结构体的复制和清零被降为memcpy/memset，污点经过它们(以及其他ArgPropagator库函数)的指针实参传播，
+    // 指针实参被污染的调用同样会访问safe region
+    auto isTrustedCall = [&](Use &U)
+    {
+        CallBase *CB = dyn_cast<CallBase>(U.getUser());
+        return CB && CB->isArgOperand(&U) && U->getType()->isPointerTy() && isMemCall(CB);
+    };
 
-    // 如果形参和对应实参有一个是敏感值，那么将另一个也设为敏感值
-    while(fItr != F->arg_end() && aItr != CS->arg_end())
+    for (auto it : crData)
     {
-        Argument *formal = const_cast<Argument *>(&(*fItr));
-        Value *actual = *aItr;
+        if (isa<LoadInst>(it) || isa<StoreInst>(it))
+            trusted.insert(it);
+        for (Use &U : it->uses())
+            if (isTrustedCall(U))
+                trusted.insert(U.getUser());
+    }
 
-        if(taintValues.find(formal) != taintValues.end())
-            ret |= taintValues.insert(actual).second;
-        else if(taintValues.find(actual) != taintValues.end())
-            ret |= taintValues.insert(formal).second;
+    // 没有被污染、但可能访问受保护对象的load/store和内存操作调用
+    for (unsigned id : accessors.ids())
+        trusted.set(id);
+}
 
-        ++fItr;
-        ++aItr;
+void COLLATEPass::instrumentTrustedInstructions(Module &M, TaintSet &trustedInsts)
+{
+    // 被污染的load/store、指针实参被污染的内存操作调用以及其他可能访问受保护对象的访存指令
+    // 是被授权访问safe region的trusted指令(collectTrustedInstructions)，在它们前后内联打开和关闭访问的序列。
+    // 其他指令(包括库函数)访问safe region会触发段错误；宽松模式下在main中插入init_handler，
+    // 由运行时的SIGSEGV handler打开访问后继续执行，直到下一条trusted指令之后再关闭。
+    MPKGate gate(M);
+    if (!gate.isSupported())
+    {
+        if (CollateSafeHeap || CollateSafeData || CollateSafeStack)
+            report_fatal_error("COLLATE: MPK gates need an x86-64 target, cannot place objects in the safe region");
+        errs() << "COLLATE: MPK gates need an x86-64 target, skip instrumentation\n";
+        return;
     }
 
-    // 实参比形参多，说明使用了可变参数列表(va_list)来传参
-    while(aItr != CS->arg_end())
+    MapVector<Function *, SmallPtrSet<Instruction *, 16>> trusted;
+    for (auto it : trustedInsts)
     {
-        Value *actual = *aItr;
-        if (taintValues.find(actual) != taintValues.end())
-            tiantVarArgs.insert(F);
-        ++aItr;
+        Instruction *I = cast<Instruction>(it);
+        gate.insertOpen(I);
+        gate.insertClose(I);
+        trusted[I->getFunction()].insert(I);
     }
 
-    return ret;
+    // 每条trusted指令一对开关的开销太大，合并相邻的开关并把只访问safe region的循环中的开关外提。
+    // 插入的开关不改变CFG，分析阶段的支配树仍然有效
+    if (CollateMPKCoalesce)
+    {
+        for (auto &it : trusted)
+        {
+            LoopInfo LI(getDomTree(*it.first));
+            gate.optimize(*it.first, it.second, LI);
+        }
+    }
+    NumGates += gate.getNumGates();
+    NumGatesRemoved += gate.getNumRemoved();
+
+    Function *F = M.getFunction("main");
+    if (CollateMPKPermissive && F && !F->isDeclaration())
+    {
+        IRBuilder<> IRB(&*F->getEntryBlock().getFirstInsertionPt());
+        FunctionCallee initHandler = M.getOrInsertFunction("init_handler", Type::getVoidTy(M.getContext()));
+        IRB.CreateCall(initHandler); // 插入init_handler，初始化sigfault处理函数
+    }
 }
 
-void COLLATEPass::dumpCrData(unordered_set<Value *> &content)
+void COLLATEPass::placeSafeObjects(Module &M, TaintSet &protectedMems, ManifestEmitter &manifest)
 {
-    int num = 0;
-    auto getLoc = [](Value *V)
+    vector<GlobalVariable *> globals;
+    MapVector<Function *, vector<AllocaInst *>> allocas;
+    for (auto it : protectedMems)
     {
-        if(Instruction *I = dyn_cast<Instruction>(V))
+        if (GlobalVariable *G = dyn_cast<GlobalVariable>(it))
+            globals.push_back(G);
+        else if (AllocaInst *AI = dyn_cast<AllocaInst>(it))
+            allocas[AI->getFunction()].push_back(AI);
+    }
+
+    SafePlacement placement(M);
+    if (CollateSafeData)
+    {
+        NumSafeGlobals += placement.relocateGlobals(globals);
+        placement.insertProtectCall();
+        for (auto &it : placement.getRelocatedGlobals())
+            manifest.relocateGlobal(it.first, it.second);
+    }
+
+    if (CollateSafeStack)
+    {
+        SmallPtrSet<Function *, 16> relocated;
+        for (auto &it : allocas)
         {
-            if(DILocation *loc = I->getDebugLoc())
-            {
-                unsigned line = loc->getLine();
-                StringRef file = loc->getFilename();
-                StringRef dir = loc->getDirectory();
-                string location = dir.str() + "/" + file.str();
-                ifstream in; 
-                string source;
-
-                in.open(location);
-                for(int i = 0;i < line; i++)
-                    getline(in, source);
-                in.close();
-                return source + "(" + location + ":" + to_string(line) + ")";
-            }
+            unsigned n = placement.relocateAllocas(*it.first, it.second);
+            if (n)
+                relocated.insert(it.first);
+            NumShadowSlots += n;
         }
-        // else if(GlobalVariable *G = dyn_cast<GlobalVariable>(V))
 
-        return string("");
+        // 被调函数可能在其他模块中使用影子栈，所有捕获异常的函数都需要恢复
+        for (auto &F : M)
+            if (!relocated.count(&F))
+                placement.restoreOnUnwind(F);
+    }
+}
+
+void COLLATEPass::saveCache(Module &M, AnalysisCache &cache, TaintSet &crData, TaintSet &mems, TaintSet &accessors,
+                            TaintSet &trusted)
+{
+    AnalysisCache::Contents C;
+
+    // 只保存预先编号的值，它们的编号在同一份IR上是确定的
+    auto toID = [&](Value *V, uint32_t &id)
+    {
+        id = valueIndex->lookup(V);
+        return id < numIndexedValues;
     };
 
-    for(auto it : content)
+    for (auto *S : M.getIdentifiedStructTypes())
     {
-        if(Instruction *I = dyn_cast<Instruction>(it))
+        if (S->hasName() && taintSourceTypes.lookup(S))
+            C.sensitiveTypes.push_back(S->getName().str());
+    }
+
+    uint32_t cs, f;
+    for (auto it : directCall2Target)
+    {
+        if (toID(it.getFirst(), cs) && toID(it.getSecond(), f))
+            C.directCalls.push_back(make_pair(cs, f));
+    }
+
+    // 目标集合在内存中是共享的，写入时同样只写一份
+    DenseMap<const CallTargets *, uint32_t> setIndex;
+    for (auto it : indirectCall2Target)
+    {
+        uint32_t op;
+        if (!toID(it.getFirst(), op))
+            continue;
+
+        auto res = setIndex.insert(make_pair(it.getSecond(), (uint32_t)C.targetSets.size()));
+        if (res.second)
         {
-            errs() << num++ << ": " << getLoc(I) << "\n\t";
-            errs() << *I << " in " << I->getFunction()->getName() << "\n";
+            C.targetSets.emplace_back();
+            for (Function *target : *it.getSecond())
+                if (toID(target, f))
+                    C.targetSets.back().push_back(f);
         }
-        else if (GlobalVariable *G = dyn_cast<GlobalVariable>(it))
+        C.indirectCalls.push_back(make_pair(op, res.first->second));
+    }
+
+    uint32_t id;
+    for (auto it : crData)
+        if (toID(it, id))
+            C.controlRelatedData.push_back(id);
+    for (auto it : mems)
+        if (toID(it, id))
+            C.memOfCrData.push_back(id);
+    for (auto it : accessors)
+        if (toID(it, id))
+            C.memAccessors.push_back(id);
+    for (auto it : trusted)
+        if (toID(it, id))
+            C.trustedInsts.push_back(id);
+
+    if (!cache.store(C, numIndexedValues))
+        errs() << "COLLATE: failed to write analysis cache " << cache.getPath() << "\n";
+}
+
+bool COLLATEPass::loadCache(Module &M, AnalysisCache &cache, TaintSet &crData, TaintSet &mems, TaintSet &accessors,
+                            TaintSet &trusted)
+{
+    AnalysisCache::Contents C;
+    if (!cache.load(C, numIndexedValues))
+        return false;
+
+    for (auto &name : C.sensitiveTypes)
+    {
+        if (StructType *S = StructType::getTypeByName(M.getContext(), name))
+            taintSourceTypes[S] = true;
+    }
+
+    for (auto &it : C.directCalls)
+    {
+        Function *f = dyn_cast<Function>(valueIndex->getValue(it.second));
+        if (f)
+            directCall2Target[valueIndex->getValue(it.first)] = f;
+    }
+
+    for (auto &set : C.targetSets)
+    {
+        cachedTargets.emplace_back();
+        for (uint32_t id : set)
+            if (Function *f = dyn_cast<Function>(valueIndex->getValue(id)))
+                cachedTargets.back().push_back(f);
+    }
+    for (auto &it : C.indirectCalls)
+        indirectCall2Target[valueIndex->getValue(it.first)] = &cachedTargets[it.second];
+
+    // 按调用指令重建被调函数 -> 调用点的映射
+    callGraph.init(M);
+    for (auto &F : M)
+    {
+        for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
         {
-            errs() << num++ << ": " << *G << "\n";
+            CallBase *CB = dyn_cast<CallBase>(&(*ii));
+            if (!CB || (!isa<CallInst>(CB) && !isa<InvokeInst>(CB)))
+                continue;
+
+            auto direct = directCall2Target.find(CB);
+            if (direct != directCall2Target.end())
+                callGraph.addEdge(direct->second, CB);
+            else if (const CallTargets *targets = indirectCall2Target.lookup(CB->getCalledOperand()))
+                for (Function *target : *targets)
+                    callGraph.addEdge(target, CB);
         }
     }
+    callGraph.finalize();
+
+    for (uint32_t id : C.controlRelatedData)
+        crData.insert(valueIndex->getValue(id));
+    for (uint32_t id : C.memOfCrData)
+        mems.insert(valueIndex->getValue(id));
+    for (uint32_t id : C.memAccessors)
+        accessors.insert(valueIndex->getValue(id));
+    for (uint32_t id : C.trustedInsts)
+        trusted.insert(valueIndex->getValue(id));
+    return true;
 }
 
-void COLLATEPass::runPointerAnalysis(Module &M)
+void COLLATEPass::collectCallees(Function &F, SmallSetVector<Function *, 8> &callees)
 {
-    SVFModule* svfModule = LLVMModuleSet::getLLVMModuleSet()->buildSVFModule(M);
-    svfModule->buildSymbolTableInfo();
-
-    SVFIRBuilder builder;
-    SVFIR *pag = builder.build(svfModule);
-    
-    DDAClient* client = new DDAClient(svfModule);
-    client->initialise(svfModule);
-    
-    ContextCond::setMaxPathLen(100000);
-    ContextCond::setMaxCxtLen(3);
+    for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
+    {
+        CallBase *CB = dyn_cast<CallBase>(&(*ii));
+        if (!CB || (!isa<CallInst>(CB) && !isa<InvokeInst>(CB)))
+            continue;
 
-    pta = new ContextDDA(pag, client);
-    pta->initialize();
-    client->answerQueries(pta);
-    pta->finalize();
+        auto direct = directCall2Target.find(CB);
+        if (direct != directCall2Target.end())
+            callees.insert(direct->second);
+        else if (const CallTargets *targets = indirectCall2Target.lookup(CB->getCalledOperand()))
+            callees.insert(targets->begin(), targets->end());
+    }
 }
 
-void COLLATEPass::getPointsToSet(Value *val, vector<Value*> &result)
+void COLLATEPass::incrementalTaintAnalysis(Module &M, TaintSet &source, TaintSet &taintedSet, TaintSet &result)
 {
-    if(!(isa<Instruction>(val) || isa<GlobalVariable>(val)))
-        return;
+    classifyTypes(M);
 
-    if(!pta->getPAG()->hasValueNode(val))
-        return;
+    IncrementalState prev, next;
+    for (auto *S : M.getIdentifiedStructTypes())
+    {
+        if (S->hasName() && taintSourceTypes.lookup(S))
+            next.sensitiveTypes.push_back(stripNumericSuffix(S->getName()).str());
+    }
+    llvm::sort(next.sensitiveTypes);
+    next.sensitiveTypes.erase(unique(next.sensitiveTypes.begin(), next.sensitiveTypes.end()), next.sensitiveTypes.end());
+
+    // 敏感类型变化时所有函数的污点源都可能变化，退化为完整分析
+    bool reuse = prev.load(CollateIncremental, funcModel.getFingerprint()) && prev.sensitiveTypes == next.sensitiveTypes;
 
-    NodeID pNodeId = pta->getPAG()->getValueNode(val);
-    const PointsTo& pts = pta->getPts(pNodeId);
-    for (PointsTo::iterator ii = pts.begin(), ie = pts.end(); ii != ie; ii++)
+    vector<Function *> changed;
+    for (auto &F : M)
     {
-        PAGNode* targetObj = pta->getPAG()->getGNode(*ii);
-        if(targetObj && !isa<DummyValVar>(targetObj) && 
-            !isa<DummyObjVar>(targetObj) && targetObj->hasValue())
+        // 没有名字的函数无法跨编译对应，总是重新分析
+        if (!F.hasName())
         {
-            Value* memObj = const_cast<Value*>(targetObj->getValue());
+            changed.push_back(&F);
+            continue;
+        }
+
+        IncrementalState::FunctionState &FS = next.functions[F.getName()];
+        FS.hash = IncrementalState::hashFunction(F);
+        auto it = prev.functions.find(F.getName());
+        if (!reuse || it == prev.functions.end() || !(it->second.hash == FS.hash))
+            changed.push_back(&F);
+    }
+
+    if (!reuse)
+    {
+        identifyTaintSources(M, source);
+        taintPropagation(M, source, taintedSet, result);
+        saveIncrementalState(M, next, source, taintedSet);
+        return;
+    }
+
+    /*受影响的函数从头分析，不复用任何旧结果。起点是：
+      变化的函数及它上一次的被调函数；被调函数的集合与上一次不同的函数(例如间接调用的目标变化)及它前后两次的被调函数；
+      被删除的函数原来的被调函数。
+      规则引擎中污点只经过调用点(实参、形参、返回值和va_list)和被污染的全局值跨函数传播，
+      因此从起点出发沿调用者、被调函数以及上一次被污染的全局值的所有使用者求闭包。
+      闭包之外的函数的旧污点不可能经过变化的部分得到，原样复用；闭包内函数使用的全局值也重新计算，
+      结果与完整分析相同。
+    */
+    StringSet<> prevTaintedGlobals, prevTaintedConstants;
+    for (auto &name : prev.taintedGlobals)
+        prevTaintedGlobals.insert(name);
+    for (auto &key : prev.taintedConstants)
+        prevTaintedConstants.insert(key);
+
+    DenseSet<Function *> affected;
+    DenseSet<Value *> recomputed; // 不复用旧污点的全局值和常量
+    vector<Function *> pending;
+    auto affect = [&](Function *F)
+    {
+        if (affected.insert(F).second)
+            pending.push_back(F);
+    };
+    auto affectOldCallees = [&](StringRef name)
+    {
+        auto it = prev.functions.find(name);
+        if (it == prev.functions.end())
+            return;
+        for (auto &callee : it->second.callees)
+            if (Function *F = M.getFunction(callee))
+                affect(F);
+    };
+
+    for (Function *F : changed)
+    {
+        affect(F);
+        if (F->hasName())
+            affectOldCallees(F->getName());
+    }
+    for (auto &F : M)
+    {
+        if (!F.hasName() || affected.count(&F))
+            continue;
 
-            // 可能出现非指针指向函数，原因不明
-            if(!isa<Function>(memObj))
-                result.push_back(memObj);
+        SmallSetVector<Function *, 8> callees;
+        collectCallees(F, callees);
+        vector<string> names;
+        for (Function *callee : callees)
+            if (callee->hasName())
+                names.push_back(callee->getName().str());
+        vector<string> old = prev.functions.find(F.getName())->second.callees;
+        llvm::sort(names);
+        llvm::sort(old);
+        if (names != old)
+        {
+            affect(&F);
+            affectOldCallees(F.getName());
         }
     }
-}
+    for (auto &it : prev.functions)
+    {
+        if (!M.getFunction(it.getKey()))
+            affectOldCallees(it.getKey());
+    }
 
-void COLLATEPass::getMemOfCrData(unordered_set<Value *> &values, unordered_set<Value *> &mems)
-{
-    for(auto it : values)
+    // 全局值和常量的使用者，经过常量表达式的间接使用也算在内
+    std::function<void(Value *)> affectUsers = [&](Value *V)
     {
-        if(LoadInst *lI = dyn_cast<LoadInst>(it))
+        for (User *U : V->users())
         {
-            vector<Value *> pts;
-            Value *pointer = lI->getPointerOperand();
-            getPointsToSet(pointer, pts);
-            for(auto t : pts)
-            {
-                if(!mems.count(t))
-                    mems.insert(t);
-            }
+            if (Instruction *I = dyn_cast<Instruction>(U))
+                affect(I->getFunction());
+            else if (isa<ConstantExpr>(U))
+                affectUsers(U);
         }
-        else if(AllocaInst *aI = dyn_cast<AllocaInst>(it))
+    };
+
+    while (!pending.empty())
+    {
+        Function *F = pending.back();
+        pending.pop_back();
+
+        for (CallBase *CB : callGraph.getCallSites(F))
+            affect(CB->getFunction());
+
+        SmallSetVector<Function *, 8> callees;
+        collectCallees(*F, callees);
+        for (Function *callee : callees)
+            affect(callee);
+
+        for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
         {
-            mems.insert(aI);
+            for (Value *operand : ii->operands())
+            {
+                Constant *C = dyn_cast<Constant>(operand);
+                if (!C || recomputed.count(C))
+                    continue;
+
+                bool wasTainted;
+                if (GlobalValue *G = dyn_cast<GlobalValue>(C))
+                    wasTainted = G->hasName() && prevTaintedGlobals.count(G->getName());
+                else
+                    wasTainted = prevTaintedConstants.count(IncrementalState::getConstantKey(C));
+                if (wasTainted)
+                {
+                    recomputed.insert(C);
+                    affectUsers(C);
+                }
+            }
         }
-        else if(GlobalVariable *gV = dyn_cast<GlobalVariable>(it))
+    }
+    stats.setCounter("incremental_changed_functions", changed.size());
+    stats.setCounter("incremental_affected_functions", affected.size());
+
+    // 复用的结果直接放入集合，不触发对使用者的检查
+    TaintWorklist worklist(taintedSet);
+    for (auto &name : prev.taintedGlobals)
+    {
+        GlobalValue *G = M.getNamedValue(name);
+        if (G && !recomputed.count(G))
+            worklist.insertQuiet(G);
+    }
+
+    identifyGlobalTaintSources(M, source);
+    for (auto &F : M)
+    {
+        collectReturnValues(F);
+        if (affected.count(&F))
         {
-            mems.insert(gV);
+            identifyTaintSources(F, source);
+            continue;
         }
+
+        const IncrementalState::FunctionState &FS = prev.functions.find(F.getName())->second;
+        FunctionSlots slots(F);
+        for (auto &slot : FS.sources)
+            if (Value *V = slots.get(slot))
+                source.insert(V);
+        for (auto &slot : FS.tainted)
+            if (Value *V = slots.get(slot))
+                worklist.insertQuiet(V);
+        if (FS.taintedReturn)
+            tiantReturnFuncs.insert(&F);
+        if (FS.taintedVarArgs)
+            tiantVarArgs.insert(&F);
+    }
+
+    // 新的污点源进入工作队列，受影响函数的每条指令都按当前的污点检查一次
+    result = source;
+    for (auto it : source)
+        worklist.insert(it);
+    for (auto &F : M)
+    {
+        if (!affected.count(&F))
+            continue;
+        for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii)
+            doInInstruction(valueIndex->lookup(&(*ii)), worklist);
+    }
+    propagateTaint(worklist);
+
+    sliceConstrainingData(taintedSet, result);
+    saveIncrementalState(M, next, source, taintedSet);
+}
+
+// 打印只在一个集合中的值，两个集合相同时返回true
+static bool compareSets(const TaintSet &expected, const TaintSet &actual, StringRef what)
+{
+    unsigned missing = 0, extra = 0;
+    for (unsigned id : expected.ids())
+    {
+        if (actual.test(id))
+            continue;
+        if (missing++ < 10)
+            errs() << "COLLATE: " << what << " misses " << *expected.getIndex().getValue(id) << "\n";
     }
+    for (unsigned id : actual.ids())
+    {
+        if (expected.test(id))
+            continue;
+        if (extra++ < 10)
+            errs() << "COLLATE: " << what << " has extra " << *actual.getIndex().getValue(id) << "\n";
+    }
+    if (missing || extra)
+        errs() << "COLLATE: " << what << ": " << missing << " missing, " << extra << " extra\n";
+    return !missing && !extra;
+}
+
+void COLLATEPass::verifyIncremental(Module &M, const TaintSet &crData)
+{
+    // 完整分析从空的跨函数状态开始，结束后这些状态与完整分析一致
+    tiantReturnFuncs.clear();
+    tiantVarArgs.clear();
+    func2RetValue.clear();
+
+    TaintSet source(*valueIndex);
+    TaintSet taintedSet(*valueIndex);
+    TaintSet full(*valueIndex);
+    identifyTaintSources(M, source);
+    taintPropagation(M, source, taintedSet, full);
+
+    if (!compareSets(full, crData, "incremental analysis"))
+        report_fatal_error(Twine("COLLATE: incremental analysis differs from a full analysis, state file ") + CollateIncremental);
 }
 
-void COLLATEPass::instrumentTrustedInstructions(Module &M, unordered_set<Value *> &protectedMems)
+void COLLATEPass::saveIncrementalState(Module &M, IncrementalState &state, const TaintSet &source, const TaintSet &taintedSet)
 {
-    // 定义A的情况下，会在所有store和库函数调用后面插入close_gate
-    // 在后面识别访问safe_region的指令时不处理函数调用指令。同时在main中插入init_handler，设置
-    // sigfault的handler，在里面会调用open_gate，这样当没有识别并授权的指令访问safe region时，
-    // 会引发段错误，然后回调handler，handler中使用open_gate允许访问，从而使访问能够正常进行，
-    // 访问结束后，close_gate禁止访问，从而不影响下一条指令的处理。
-    // #define A
-    #ifdef A
-    // 在所有store指令后插入close_gate，因为在sigfault的handler里会open_gate，
-    // 为了防止open后就一直运行访问safe region，需要进行关闭
-    // 在库函数调用指令前后插入open_gate和close_gate，暂时不管它
     for (auto &F : M)
     {
-        if (F.isDeclaration() || F.isIntrinsic())
+        if (!F.hasName())
             continue;
-        
-        IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
 
-        if(F.getName() == "main")
-        {
-            FunctionCallee initHandler = M.getOrInsertFunction("init_handler", Type::getVoidTy(M.getContext()));
-            IRB.CreateCall(initHandler); // 插入init_handler，初始化sigfault处理函数
-        }
+        IncrementalState::FunctionState &FS = state.functions[F.getName()];
+        FS.taintedReturn = tiantReturnFuncs.count(&F);
+        FS.taintedVarArgs = tiantVarArgs.count(&F);
 
-        for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; I++)
+        FunctionSlots slots(F);
+        const vector<Value *> &locals = slots.getLocals();
+        DenseSet<Value *> seen;
+        for (uint32_t i = 0; i < locals.size(); i++)
         {
-            if (isa<LandingPadInst>(*I))
+            if (source.count(locals[i]))
+                FS.sources.push_back(make_pair(i, 0U));
+            if (taintedSet.count(locals[i]))
+                FS.tainted.push_back(make_pair(i, 0U));
+
+            // 常量和全局值不属于任何函数，记在本函数中第一次使用它的操作数上
+            Instruction *I = dyn_cast<Instruction>(locals[i]);
+            if (!I)
                 continue;
-            findConstantExpr(&(*I));
+            for (uint32_t op = 0; op < I->getNumOperands(); op++)
+            {
+                Value *operand = I->getOperand(op);
+                if (isa<Instruction>(operand) || isa<Argument>(operand) || isa<BasicBlock>(operand) ||
+                    !seen.insert(operand).second)
+                    continue;
+                if (source.count(operand))
+                    FS.sources.push_back(make_pair(i, op + 1));
+                if (taintedSet.count(operand))
+                    FS.tainted.push_back(make_pair(i, op + 1));
+            }
         }
+
+        SmallSetVector<Function *, 8> callees;
+        collectCallees(F, callees);
+        for (Function *callee : callees)
+            if (callee->hasName())
+                FS.callees.push_back(callee->getName().str());
+    }
+
+    for (auto &G : M.global_values())
+    {
+        if (G.hasName() && taintedSet.count(&G))
+            state.taintedGlobals.push_back(G.getName().str());
     }
+
+    for (unsigned id : taintedSet.ids())
+    {
+        Constant *C = dyn_cast<Constant>(valueIndex->getValue(id));
+        if (C && !isa<GlobalValue>(C))
+            state.taintedConstants.push_back(IncrementalState::getConstantKey(C));
+    }
+    llvm::sort(state.taintedConstants);
+    state.taintedConstants.erase(unique(state.taintedConstants.begin(), state.taintedConstants.end()),
+                                 state.taintedConstants.end());
+
+    if (!state.store(CollateIncremental, funcModel.getFingerprint()))
+        errs() << "COLLATE: failed to write incremental state " << CollateIncremental << "\n";
 }
 
 bool COLLATEPass::runOnModule(Module &M)
 {
-    constantExpr2Instruction(M);
-    analyzeStructTypeEquality(M);
+    // 运行时启动时就关闭COLLATE的pkey，safe region中的对象只能在trusted指令的开关之间访问，
+    // 没有插入开关时第一次访问就会触发段错误
+    if ((CollateSafeHeap || CollateSafeData || CollateSafeStack) && !CollateMPK)
+        report_fatal_error("COLLATE: -collate-safe-heap, -collate-safe-data and -collate-safe-stack require -collate-mpk");
+
+    if (!CollateFuncModel.empty())
+    {
+        string error;
+        if (!funcModel.loadFile(CollateFuncModel, error))
+            errs() << "COLLATE: " << error << "\n";
+    }
+    // 函数的分类不在缓存中，命中时同样需要：trusted指令的判定和开关都依赖它
+    funcModel.classify(M);
 
-    unordered_set<Value *> taintSource;
-    identifyTaintSources(M, taintSource);
+    // 缓存的键基于输入的模块，要在修改IR之前计算
+    unique_ptr<AnalysisCache> cache;
+    if (!CollateCacheDir.empty())
+        cache.reset(new AnalysisCache(CollateCacheDir, M, getOptionsFingerprint()));
 
-    unordered_set<Value *> controlRelatedData;
-    taintPropagation(M, taintSource, controlRelatedData);
+    {
+        AnalysisStats::Scope S(stats, "buildSVFModule");
+        svf.reset(new SVFContext(M));
+    }
+    {
+        AnalysisStats::Scope S(stats, "constantExpr2Instruction");
+        constantExpr2Instruction(M);
+    }
+
+    valueIndex.reset(new ValueIndex(M));
+    numIndexedValues = valueIndex->size();
+
+    TaintSet controlRelatedData(*valueIndex);
+    TaintSet memOfCrData(*valueIndex);
+    TaintSet memAccessors(*valueIndex);
+    TaintSet cachedTrusted(*valueIndex);
+    bool cached = false;
+    if (cache)
+    {
+        AnalysisStats::Scope S(stats, "loadCache");
+        cached = loadCache(M, *cache, controlRelatedData, memOfCrData, memAccessors, cachedTrusted);
+    }
+
+    if (!cached)
+    {
+        {
+            AnalysisStats::Scope S(stats, "analyzeStructTypeEquality");
+            analyzeStructTypeEquality(M);
+        }
+        {
+            AnalysisStats::Scope S(stats, "analyzeIndirectCalls");
+            analyzeIndirectCalls(M);
+        }
+
+        TaintSet taintSource(*valueIndex);
+        TaintSet taintedSet(*valueIndex);
+        // 增量分析保存的是规则引擎的函数内结果，SVFG引擎总是完整分析
+        if (!CollateIncremental.empty() && CollateTaintEngine != TE_Rules)
+            errs() << "COLLATE: -collate-incremental only applies to the rules taint engine, running a full analysis\n";
+        if (!CollateIncremental.empty() && CollateTaintEngine == TE_Rules)
+        {
+            {
+                AnalysisStats::Scope S(stats, "incrementalTaintAnalysis");
+                incrementalTaintAnalysis(M, taintSource, taintedSet, controlRelatedData);
+            }
+            if (CollateVerify)
+            {
+                AnalysisStats::Scope S(stats, "verifyIncremental");
+                verifyIncremental(M, controlRelatedData);
+            }
+        }
+        else
+        {
+            {
+                AnalysisStats::Scope S(stats, "identifyTaintSources");
+                identifyTaintSources(M, taintSource);
+            }
+            AnalysisStats::Scope S(stats, "taintPropagation");
+            taintPropagation(M, taintSource, taintedSet, controlRelatedData);
+        }
+
+        NumTaintSources += taintSource.size();
+        NumTaintedValues += taintedSet.size();
+        stats.setCounter("taint_sources", taintSource.size());
+        stats.setCounter("tainted_values", taintedSet.size());
+    }
 
-    dumpCrData(controlRelatedData);
+    {
+        AnalysisStats::Scope S(stats, "dumpCrData");
+        dumpCrData(M, controlRelatedData);
+    }
+
+    if (!cached)
+    {
+        {
+            AnalysisStats::Scope S(stats, "runPointerAnalysis");
+            runPointerAnalysis(M, controlRelatedData);
+        }
+        {
+            AnalysisStats::Scope S(stats, "getMemOfCrData");
+            getMemOfCrData(controlRelatedData, memOfCrData);
+        }
+        {
+            AnalysisStats::Scope S(stats, "getAccessorsOfMems");
+            getAccessorsOfMems(M, memOfCrData, memAccessors);
+        }
+
+        NumPTAQueries += ddaClient->getNumQueries();
+        stats.setCounter("pta_queries", ddaClient->getNumQueries());
+        stats.setCounter("pta_fallbacks", ddaClient->getNumFallbacks());
+    }
+
+    // trusted指令由控制相关数据、受保护对象的访问和函数的分类决定，命中缓存时重新计算
+    TaintSet trustedInsts(*valueIndex);
+    collectTrustedInstructions(controlRelatedData, memAccessors, trustedInsts);
+    if (!cached && cache)
+        saveCache(M, *cache, controlRelatedData, memOfCrData, memAccessors, trustedInsts);
+    if (cached && CollateVerify && !compareSets(cachedTrusted, trustedInsts, "cached analysis"))
+        report_fatal_error(Twine("COLLATE: trusted instructions differ from the run that wrote ") + cache->getPath());
+
+    NumCrData += controlRelatedData.size();
+    NumProtectedMems += memOfCrData.size();
+    stats.setCounter("indexed_values", numIndexedValues);
+    stats.setCounter("control_related_data", controlRelatedData.size());
+    stats.setCounter("protected_memory_objects", memOfCrData.size());
+    stats.setCounter("protected_memory_accessors", memAccessors.size());
+
+    // 给受保护的栈对象和分配点编号，safe region的分配器按编号选择分配点，清单按编号记录它们最终的位置
+    ManifestEmitter manifest(M);
+    for (auto it : memOfCrData)
+        manifest.addObject(it);
+    manifest.tagSites();
+
+    if (CollateSafeHeap)
+    {
+        SafeHeap heap(M);
+        NumSafeAllocSites += heap.redirectAllocSites();
+        heap.redirectDeallocations();
+    }
+
+    if (CollateMPK)
+    {
+        AnalysisStats::Scope S(stats, "instrumentTrustedInstructions");
+        instrumentTrustedInstructions(M, trustedInsts);
+    }
+
+    // 污点传播和开关的优化之后不再需要支配树，后面的变换会修改CFG
+    domTrees.clear();
+
+    if (CollateSafeData || CollateSafeStack)
+    {
+        AnalysisStats::Scope S(stats, "placeSafeObjects");
+        placeSafeObjects(M, memOfCrData, manifest);
+    }
+
+    // 清单在所有变换之后生成
+    if (CollateManifest)
+        manifest.emit();
 
-    runPointerAnalysis(M);
+    // 指针分析的结果已经转存到memOfCrData，先释放SVF(其中的ContextDDA引用了client)，再释放client
+    pta = nullptr;
+    {
+        AnalysisStats::Scope S(stats, "releaseSVF");
+        svf.reset();
+        ddaClient.reset();
+    }
 
-    unordered_set<Value *> memOfCrData;
-    getMemOfCrData(controlRelatedData, memOfCrData);
+    if (CollateStats)
+        stats.print(errs());
+    if (!CollateStatsJSON.empty())
+    {
+        error_code EC;
+        raw_fd_ostream OS(CollateStatsJSON, EC, sys::fs::OF_None);
+        if (EC)
+            errs() << "COLLATE: cannot open " << CollateStatsJSON << ": " << EC.message() << "\n";
+        else
+            stats.writeJSON(OS);
+    }
     return true;
 }
 
@@ -0,0 +1,192 @@
+#include "../../include/analysis_cache.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace COLLATE;
+
+static const char CacheMagic[4] = {'C', 'L', 'T', 'C'};
+
+AnalysisCache::AnalysisCache(StringRef dir, Module &M, StringRef options)
+{
+    // 以bitcode内容、缓存格式版本和选项计算键
+    SmallVector<char, 0> buffer;
+    raw_svector_ostream bcOS(buffer);
+    WriteBitcodeToFile(M, bcOS);
+
+    MD5 hash;
+    hash.update(StringRef(buffer.data(), buffer.size()));
+    hash.update(std::to_string(Version));
+    hash.update(options);
+    MD5::MD5Result result;
+    hash.final(result);
+
+    SmallString<128> file(dir);
+    sys::path::append(file, result.digest() + ".collate");
+    path = file.str().str();
+}
+
+bool AnalysisCache::load(Contents &C, uint32_t numValues)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+    if (!buf)
+        return false;
+
+    StringRef data = (*buf)->getBuffer();
+    if (data.size() < sizeof(CacheMagic) || !data.startswith(StringRef(CacheMagic, sizeof(CacheMagic))))
+        return false;
+
+    DataExtractor DE(data, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+    DataExtractor::Cursor cur(sizeof(CacheMagic));
+
+    auto readIDs = [&](std::vector<uint32_t> &ids)
+    {
+        uint32_t n = DE.getU32(cur);
+        for (uint32_t i = 0; i < n && cur; i++)
+        {
+            uint32_t id = DE.getU32(cur);
+            if (id < numValues)
+                ids.push_back(id);
+        }
+    };
+
+    auto readPairs = [&](std::vector<std::pair<uint32_t, uint32_t>> &pairs)
+    {
+        uint32_t n = DE.getU32(cur);
+        for (uint32_t i = 0; i < n && cur; i++)
+        {
+            uint32_t first = DE.getU32(cur);
+            uint32_t second = DE.getU32(cur);
+            pairs.push_back(std::make_pair(first, second));
+        }
+    };
+
+    if (DE.getU32(cur) != Version || DE.getU32(cur) != numValues)
+    {
+        consumeError(cur.takeError());
+        return false;
+    }
+
+    uint32_t numTypes = DE.getU32(cur);
+    for (uint32_t i = 0; i < numTypes && cur; i++)
+    {
+        uint32_t len = DE.getU32(cur);
+        StringRef name = DE.getBytes(cur, len);
+        C.sensitiveTypes.push_back(name.str());
+    }
+
+    readPairs(C.directCalls);
+
+    uint32_t numSets = DE.getU32(cur);
+    for (uint32_t i = 0; i < numSets && cur; i++)
+    {
+        C.targetSets.emplace_back();
+        readIDs(C.targetSets.back());
+    }
+
+    readPairs(C.indirectCalls);
+    readIDs(C.controlRelatedData);
+    readIDs(C.memOfCrData);
+    readIDs(C.memAccessors);
+    readIDs(C.trustedInsts);
+
+    if (Error err = cur.takeError())
+    {
+        consumeError(std::move(err));
+        C = Contents();
+        return false;
+    }
+
+    // 校验编号，损坏的缓存按未命中处理
+    for (auto &it : C.directCalls)
+        if (it.first >= numValues || it.second >= numValues)
+            return false;
+    for (auto &it : C.indirectCalls)
+        if (it.first >= numValues || it.second >= C.targetSets.size())
+            return false;
+    for (uint32_t id : C.memAccessors)
+        if (id >= numValues)
+            return false;
+    for (uint32_t id : C.trustedInsts)
+        if (id >= numValues)
+            return false;
+    return true;
+}
+
+bool AnalysisCache::store(const Contents &C, uint32_t numValues)
+{
+    // 先写到临时文件再改名，避免并行构建读到写了一半的缓存
+    SmallString<128> tmpPath;
+    int fd;
+    if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmpPath))
+        return false;
+
+    {
+        raw_fd_ostream OS(fd, /*shouldClose=*/true);
+        support::endian::Writer W(OS, support::little);
+
+        auto writeIDs = [&](const std::vector<uint32_t> &ids)
+        {
+            W.write<uint32_t>(ids.size());
+            for (uint32_t id : ids)
+                W.write<uint32_t>(id);
+        };
+
+        auto writePairs = [&](const std::vector<std::pair<uint32_t, uint32_t>> &pairs)
+        {
+            W.write<uint32_t>(pairs.size());
+            for (auto &it : pairs)
+            {
+                W.write<uint32_t>(it.first);
+                W.write<uint32_t>(it.second);
+            }
+        };
+
+        OS.write(CacheMagic, sizeof(CacheMagic));
+        W.write<uint32_t>(Version);
+        W.write<uint32_t>(numValues);
+
+        W.write<uint32_t>(C.sensitiveTypes.size());
+        for (auto &name : C.sensitiveTypes)
+        {
+            W.write<uint32_t>(name.size());
+            OS << name;
+        }
+
+        writePairs(C.directCalls);
+
+        W.write<uint32_t>(C.targetSets.size());
+        for (auto &set : C.targetSets)
+            writeIDs(set);
+
+        writePairs(C.indirectCalls);
+        writeIDs(C.controlRelatedData);
+        writeIDs(C.memOfCrData);
+        writeIDs(C.memAccessors);
+        writeIDs(C.trustedInsts);
+
+        OS.close();
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            sys::fs::remove(tmpPath);
+            return false;
+        }
+    }
+
+    if (sys::fs::rename(tmpPath, path))
+    {
+        sys::fs::remove(tmpPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,120 @@
+#include "../../include/analysis_stats.hpp"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+#include <sys/resource.h>
+
+using namespace llvm;
+using namespace COLLATE;
+
+AnalysisStats::Scope::Scope(AnalysisStats &stats, StringRef name) : stats(stats), phase(stats.phases.size())
+{
+    stats.phases.emplace_back();
+    Phase &P = stats.phases.back();
+    P.timer.reset(new Timer(name, name, stats.group));
+    P.timer->startTimer();
+}
+
+AnalysisStats::Scope::~Scope()
+{
+    Phase &P = stats.phases[phase];
+    P.timer->stopTimer();
+    P.peakRSS = getPeakRSS();
+}
+
+AnalysisStats::AnalysisStats() : group("collate", "COLLATE analysis phases") {}
+
+AnalysisStats::~AnalysisStats()
+{
+    // 没有调用print时不让TimerGroup在析构时打印报告
+    group.clear();
+}
+
+void AnalysisStats::setCounter(StringRef name, uint64_t value)
+{
+    for (auto &it : counters)
+    {
+        if (it.first == name)
+        {
+            it.second = value;
+            return;
+        }
+    }
+    counters.push_back(std::make_pair(name.str(), value));
+}
+
+void AnalysisStats::addRound(double wallSeconds, uint64_t instructions)
+{
+    rounds.push_back(std::make_pair(wallSeconds, instructions));
+}
+
+uint64_t AnalysisStats::getPeakRSS()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+    // Linux上ru_maxrss的单位是KB
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+void AnalysisStats::print(raw_ostream &OS)
+{
+    group.print(OS);
+
+    OS << "===" << std::string(73, '-') << "===\n";
+    OS << "                       COLLATE analysis counters\n";
+    OS << "===" << std::string(73, '-') << "===\n";
+    for (auto &P : phases)
+        OS << format("%12llu", (unsigned long long)P.peakRSS) << "  peak RSS after " << P.timer->getName() << "\n";
+    for (auto &it : counters)
+        OS << format("%12llu", (unsigned long long)it.second) << "  " << it.first << "\n";
+    for (unsigned i = 0; i < rounds.size(); i++)
+        OS << format("%12.4f", rounds[i].first) << "  seconds in propagation round " << i
+           << " (" << rounds[i].second << " instructions)\n";
+    OS << "\n";
+}
+
+void AnalysisStats::writeJSON(raw_ostream &OS) const
+{
+    json::OStream J(OS, /*IndentSize=*/2);
+    J.object([&]()
+    {
+        J.attributeArray("phases", [&]()
+        {
+            for (auto &P : phases)
+            {
+                TimeRecord T = P.timer->getTotalTime();
+                J.object([&]()
+                {
+                    J.attribute("name", P.timer->getName());
+                    J.attribute("wall_seconds", T.getWallTime());
+                    J.attribute("user_seconds", T.getUserTime());
+                    J.attribute("system_seconds", T.getSystemTime());
+                    J.attribute("peak_rss_bytes", (int64_t)P.peakRSS);
+                });
+            }
+        });
+
+        J.attributeArray("propagation_rounds", [&]()
+        {
+            for (auto &R : rounds)
+            {
+                J.object([&]()
+                {
+                    J.attribute("wall_seconds", R.first);
+                    J.attribute("instructions", (int64_t)R.second);
+                });
+            }
+        });
+
+        J.attributeObject("counters", [&]()
+        {
+            for (auto &it : counters)
+                J.attribute(it.first, (int64_t)it.second);
+        });
+
+        J.attribute("peak_rss_bytes", (int64_t)getPeakRSS());
+    });
+    OS << "\n";
+}
@@ -0,0 +1,40 @@
+#include "../../include/call_graph.hpp"
+
+using namespace llvm;
+using namespace COLLATE;
+
+void ReverseCallGraph::init(Module &M)
+{
+    funcIndex.clear();
+    edges.clear();
+    offsets.clear();
+    callSites.clear();
+
+    for (auto &F : M)
+        funcIndex.insert(std::make_pair(&F, (unsigned)funcIndex.size()));
+}
+
+void ReverseCallGraph::addEdge(Function *callee, CallBase *CB)
+{
+    auto it = funcIndex.find(callee);
+    if (it != funcIndex.end())
+        edges.push_back(std::make_pair(it->second, CB));
+}
+
+void ReverseCallGraph::finalize()
+{
+    offsets.assign(funcIndex.size() + 1, 0);
+    for (auto &edge : edges)
+        offsets[edge.first + 1]++;
+    for (unsigned i = 0; i < funcIndex.size(); i++)
+        offsets[i + 1] += offsets[i];
+
+    // next[i]是第i个函数的下一个空位
+    std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    callSites.resize(edges.size());
+    for (auto &edge : edges)
+        callSites[next[edge.first]++] = edge.second;
+
+    edges.clear();
+    edges.shrink_to_fit();
+}
@@ -0,0 +1,104 @@
+#include "../../include/dda_client.hpp"
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instruction.h"
+
+#include "MemoryModel/PointerAnalysisImpl.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace llvm;
+using namespace SVF;
+using namespace COLLATE;
+
+void CollateDDAClient::addQuery(const Value *ptr)
+{
+    if (isa<Instruction>(ptr) || isa<GlobalVariable>(ptr))
+        queries.insert(ptr);
+}
+
+OrderedNodeSet &CollateDDAClient::collectCandidateQueries(SVFIR *p)
+{
+    setPAG(p);
+    for (const Value *ptr : queries)
+    {
+        if (p->hasValueNode(ptr))
+            addCandidate(p->getValueNode(ptr));
+    }
+    return candidateQueries;
+}
+
+void CollateDDAClient::answerQueries(PointerAnalysis *pta)
+{
+    collectCandidateQueries(pta->getPAG());
+
+    auto start = std::chrono::steady_clock::now();
+    for (NodeID id : candidateQueries)
+    {
+        if (timeBudget > 0 && fallbackPTA)
+        {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed.count() > timeBudget)
+            {
+                numFallbacks = candidateQueries.size() - answered.size();
+                break;
+            }
+        }
+
+        setCurrentQueryPtr(id);
+        pta->computeDDAPts(id);
+        answered.insert(id);
+    }
+}
+
+void CollateDDAClient::collectResults(PointerAnalysis *pta)
+{
+    SVFIR *pag = pta->getPAG();
+
+    // 指向同一个PAG节点的指针共享同一段结果
+    DenseMap<NodeID, std::pair<uint32_t, uint32_t>> nodeRanges;
+    for (const Value *ptr : queries)
+    {
+        if (!pag->hasValueNode(ptr))
+            continue;
+
+        NodeID id = pag->getValueNode(ptr);
+        auto res = nodeRanges.insert(std::make_pair(id, std::make_pair(0U, 0U)));
+        if (res.second)
+        {
+            uint32_t begin = objects.size();
+            // 超出时间预算而没有回答的查询使用fallback的结果
+            PointerAnalysis *source = (numFallbacks && !answered.count(id)) ? fallbackPTA : pta;
+            const PointsTo &pts = source->getPts(id);
+            for (PointsTo::iterator ii = pts.begin(), ie = pts.end(); ii != ie; ii++)
+            {
+                PAGNode *targetObj = pag->getGNode(*ii);
+                if (targetObj && !isa<DummyValVar>(targetObj) &&
+                    !isa<DummyObjVar>(targetObj) && targetObj->hasValue())
+                {
+                    Value *memObj = const_cast<Value *>(targetObj->getValue());
+
+                    // 可能出现非指针指向函数，原因不明
+                    if (!isa<Function>(memObj))
+                        objects.push_back(memObj);
+                }
+            }
+
+            // 同一个对象的不同字段对应不同的节点，只保留一份
+            std::sort(objects.begin() + begin, objects.end());
+            objects.erase(std::unique(objects.begin() + begin, objects.end()), objects.end());
+            res.first->second = std::make_pair(begin, (uint32_t)objects.size());
+        }
+        ranges[ptr] = res.first->second;
+    }
+}
+
+ArrayRef<Value *> CollateDDAClient::getPointsTo(const Value *ptr) const
+{
+    auto it = ranges.find(ptr);
+    if (it == ranges.end())
+        return ArrayRef<Value *>();
+    return makeArrayRef(objects).slice(it->second.first, it->second.second - it->second.first);
+}
@@ -0,0 +1,99 @@
+#include "../../include/func_model.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+using namespace COLLATE;
+
+FunctionModel::FunctionModel()
+{
+    const char *ignoreFuncs[] = {
+    // c functions
+    "__cxa_atexit", "realloc", "free", "obstack_free",
+    "printf", "sprintf", "vsprintf", "fprintf", "vfprintf",
+    "read", "puts", "scanf", "fread", "fgets", "fputs", "fwrite", 
+    "sscanf", "memchr", "memcmp", "strlen", "strchr", "strtoul", 
+    "strcmp", "strncmp", "strcpy", "strncpy", "strrchr", "strcat",
+    "strtol", "strpbrk", "strstr", "strcspn", "strspn", "strerror", 
+    "strtok", "strtod", "bsearch", "remove", "getenv",
+    // c++ functions
+    "_ZdlPv", "_ZdaPv", "__cxa_begin_catch", "_ZSt20__throw_length_errorPKc", 
+    "__cxa_free_exception", "_cxa_throw", "__dynamic_cast", nullptr};
+    for (unsigned i = 0; ignoreFuncs[i] != nullptr; ++i)
+        addRule(ignoreFuncs[i], Ignored);
+
+    // 与原来的strncmp一致，按前缀匹配(如llvm.memcpy.p0i8.p0i8.i64)
+    addRule("memcpy*", ArgPropagator);
+    addRule("llvm.memcpy*", ArgPropagator);
+}
+
+void FunctionModel::addRule(StringRef pattern, Kind kind)
+{
+    if (pattern.endswith("*"))
+        prefixes.push_back(std::make_pair(pattern.drop_back().str(), kind));
+    else
+        exact[pattern] = kind;
+}
+
+bool FunctionModel::loadFile(StringRef path, std::string &error)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+    if (!buf)
+    {
+        error = "cannot read function model " + path.str() + ": " + buf.getError().message();
+        return false;
+    }
+
+    StringRef data = (*buf)->getBuffer();
+    MD5 hash;
+    hash.update(data);
+    MD5::MD5Result result;
+    hash.final(result);
+    fingerprint = result.digest().str().str();
+
+    SmallVector<StringRef, 0> lines;
+    data.split(lines, '\n');
+    for (unsigned i = 0; i < lines.size(); i++)
+    {
+        StringRef line = lines[i].split('#').first.trim();
+        if (line.empty())
+            continue;
+
+        std::pair<StringRef, StringRef> rule = line.split(' ');
+        StringRef pattern = rule.second.trim();
+        if (pattern.empty() || (rule.first != "ignore" && rule.first != "propagate"))
+        {
+            error = path.str() + ":" + std::to_string(i + 1) + ": expected 'ignore <name>' or 'propagate <name>'";
+            return false;
+        }
+        addRule(pattern, rule.first == "ignore" ? Ignored : ArgPropagator);
+    }
+    return true;
+}
+
+FunctionModel::Kind FunctionModel::match(const Function &F) const
+{
+    StringRef name = F.getName();
+    auto it = exact.find(name);
+    if (it != exact.end())
+        return it->second;
+
+    for (auto &prefix : prefixes)
+        if (name.startswith(prefix.first))
+            return prefix.second;
+
+    return F.isIntrinsic() ? Intrinsic : Normal;
+}
+
+void FunctionModel::classify(Module &M)
+{
+    kinds.clear();
+    for (auto &F : M)
+    {
+        Kind kind = match(F);
+        if (kind != Normal)
+            kinds[&F] = kind;
+    }
+}
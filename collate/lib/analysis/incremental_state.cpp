@@ -0,0 +1,432 @@
+#include "../../include/incremental_state.hpp"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace COLLATE;
+
+static const char StateMagic[4] = {'C', 'L', 'T', 'I'};
+
+FunctionSlots::FunctionSlots(Function &F)
+{
+    for (auto &A : F.args())
+        locals.push_back(&A);
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        locals.push_back(&(*I));
+}
+
+Value *FunctionSlots::get(Slot S) const
+{
+    if (S.first >= locals.size())
+        return nullptr;
+
+    Value *V = locals[S.first];
+    if (S.second == 0)
+        return V;
+
+    Instruction *I = dyn_cast<Instruction>(V);
+    if (!I || S.second > I->getNumOperands())
+        return nullptr;
+    return I->getOperand(S.second - 1);
+}
+
+namespace
+{
+    // 对函数的内容逐项计算哈希，局部的值按FunctionSlots的编号、基本块按顺序计入
+    class FunctionHasher
+    {
+    public:
+        explicit FunctionHasher(Function &F)
+        {
+            uint32_t n = 0;
+            for (auto &A : F.args())
+                locals[&A] = n++;
+            for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+                locals[&(*I)] = n++;
+            n = 0;
+            for (auto &BB : F)
+                blocks[&BB] = n++;
+        }
+
+        void add(uint64_t v)
+        {
+            uint8_t bytes[sizeof(v)];
+            support::endian::write64le(bytes, v);
+            hash.update(makeArrayRef(bytes));
+        }
+
+        void add(StringRef str)
+        {
+            add(str.size());
+            hash.update(str);
+        }
+
+        void addType(Type *Ty)
+        {
+            add(Ty->getTypeID());
+            if (StructType *sTy = dyn_cast<StructType>(Ty))
+            {
+                // 具名结构体只计入名字，也避免在递归类型上无限展开
+                if (sTy->hasName())
+                    return add(stripNumericSuffix(sTy->getName()));
+                add(sTy->isPacked());
+            }
+            else if (IntegerType *iTy = dyn_cast<IntegerType>(Ty))
+                add(iTy->getBitWidth());
+            else if (ArrayType *aTy = dyn_cast<ArrayType>(Ty))
+                add(aTy->getNumElements());
+            else if (VectorType *vTy = dyn_cast<VectorType>(Ty))
+                add(vTy->getElementCount().getKnownMinValue());
+            else if (PointerType *pTy = dyn_cast<PointerType>(Ty))
+                add(pTy->getAddressSpace());
+            else if (FunctionType *fTy = dyn_cast<FunctionType>(Ty))
+                add(fTy->isVarArg());
+
+            add(Ty->getNumContainedTypes());
+            for (Type *subTy : Ty->subtypes())
+                addType(subTy);
+        }
+
+        void addAPInt(const APInt &v)
+        {
+            add(v.getBitWidth());
+            for (unsigned i = 0; i < v.getNumWords(); i++)
+                add(v.getRawData()[i]);
+        }
+
+        void addValue(Value *V)
+        {
+            add(V->getValueID());
+
+            auto local = locals.find(V);
+            if (local != locals.end())
+                return add(local->second);
+            if (BasicBlock *BB = dyn_cast<BasicBlock>(V))
+                return add(blocks.lookup(BB));
+            if (GlobalValue *GV = dyn_cast<GlobalValue>(V))
+                return add(GV->getName());
+            if (MetadataAsValue *MV = dyn_cast<MetadataAsValue>(V))
+            {
+                if (MDString *str = dyn_cast<MDString>(MV->getMetadata()))
+                    add(str->getString());
+                return;
+            }
+            if (InlineAsm *IA = dyn_cast<InlineAsm>(V))
+            {
+                addType(IA->getFunctionType());
+                add(IA->getAsmString());
+                add(IA->getConstraintString());
+                return add(IA->hasSideEffects());
+            }
+
+            addType(V->getType());
+            if (ConstantInt *CI = dyn_cast<ConstantInt>(V))
+                addAPInt(CI->getValue());
+            else if (ConstantFP *CF = dyn_cast<ConstantFP>(V))
+                addAPInt(CF->getValueAPF().bitcastToAPInt());
+            else if (ConstantDataSequential *CD = dyn_cast<ConstantDataSequential>(V))
+                add(CD->getRawDataValues());
+            else if (BlockAddress *BA = dyn_cast<BlockAddress>(V))
+            {
+                add(BA->getFunction()->getName());
+                add(BA->getBasicBlock()->getName());
+            }
+            else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V))
+            {
+                add(CE->getOpcode());
+                if (CE->isCompare())
+                    add(CE->getPredicate());
+                if (GEPOperator *GEP = dyn_cast<GEPOperator>(CE))
+                    addType(GEP->getSourceElementType());
+            }
+
+            // 常量表达式和聚合常量按操作数展开，没有操作数的常量(null、undef等)只有类型
+            if (Constant *C = dyn_cast<Constant>(V))
+            {
+                add(C->getNumOperands());
+                for (Value *op : C->operands())
+                    addValue(op);
+            }
+        }
+
+        void addInstruction(Instruction &I)
+        {
+            add(I.getOpcode());
+            addType(I.getType());
+
+            if (CmpInst *CI = dyn_cast<CmpInst>(&I))
+                add(CI->getPredicate());
+            else if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+                addType(AI->getAllocatedType());
+            else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I))
+            {
+                addType(GEP->getSourceElementType());
+                add(GEP->isInBounds());
+            }
+            else if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+                add(LI->isVolatile());
+            else if (StoreInst *SI = dyn_cast<StoreInst>(&I))
+                add(SI->isVolatile());
+            else if (PHINode *PN = dyn_cast<PHINode>(&I))
+            {
+                for (BasicBlock *BB : PN->blocks())
+                    add(blocks.lookup(BB));
+            }
+            else if (ExtractValueInst *EV = dyn_cast<ExtractValueInst>(&I))
+            {
+                for (unsigned idx : EV->indices())
+                    add(idx);
+            }
+            else if (InsertValueInst *IV = dyn_cast<InsertValueInst>(&I))
+            {
+                for (unsigned idx : IV->indices())
+                    add(idx);
+            }
+            else if (ShuffleVectorInst *SV = dyn_cast<ShuffleVectorInst>(&I))
+            {
+                for (int idx : SV->getShuffleMask())
+                    add(idx);
+            }
+            else if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I))
+                add(RMW->getOperation());
+            else if (LandingPadInst *LP = dyn_cast<LandingPadInst>(&I))
+                add(LP->isCleanup());
+            else if (CallBase *CB = dyn_cast<CallBase>(&I))
+            {
+                // 属性按内容计入，属性组的编号是模块全局的
+                addType(CB->getFunctionType());
+                add(CB->getCallingConv());
+                add(CB->getAttributes().getAsString(AttributeList::FunctionIndex));
+            }
+
+            add(I.getNumOperands());
+            for (Value *op : I.operands())
+                addValue(op);
+
+            MDNode *tag = I.getMetadata(LLVMContext::MD_tbaa);
+            if (tag && tag->getNumOperands() > 1)
+            {
+                MDNode *access = dyn_cast<MDNode>(tag->getOperand(1));
+                if (access && access->getNumOperands() > 0)
+                    if (MDString *name = dyn_cast<MDString>(access->getOperand(0)))
+                        add(name->getString());
+            }
+        }
+
+        MD5 hash;
+
+    private:
+        DenseMap<Value *, uint32_t> locals;
+        DenseMap<BasicBlock *, uint32_t> blocks;
+    };
+}
+
+StringRef COLLATE::stripNumericSuffix(StringRef name)
+{
+    while (true)
+    {
+        size_t dot = name.rfind('.');
+        if (dot == StringRef::npos || dot + 1 == name.size())
+            return name;
+
+        StringRef suffix = name.substr(dot + 1);
+        if (!all_of(suffix, isDigit))
+            return name;
+        name = name.substr(0, dot);
+    }
+}
+
+MD5::MD5Result IncrementalState::hashFunction(Function &F)
+{
+    FunctionHasher H(F);
+    H.addType(F.getFunctionType());
+    H.add(F.getAttributes().getAsString(AttributeList::FunctionIndex));
+
+    for (auto &BB : F)
+    {
+        H.add(BB.size());
+        for (auto &I : BB)
+        {
+            // 调试信息只计入位置：它们占用局部编号，增删时保存的槽位也会移动
+            if (DbgInfoIntrinsic *DI = dyn_cast<DbgInfoIntrinsic>(&I))
+                H.add(DI->getIntrinsicID());
+            else
+                H.addInstruction(I);
+        }
+    }
+
+    MD5::MD5Result result;
+    H.hash.final(result);
+    return result;
+}
+
+std::string IncrementalState::getConstantKey(const Constant *C)
+{
+    if (const ConstantInt *CI = dyn_cast<ConstantInt>(C))
+        return "int" + utostr(CI->getBitWidth()) + ":" + toString(CI->getValue(), 10, false);
+    return "value" + utostr(C->getValueID());
+}
+
+bool IncrementalState::load(StringRef path, StringRef options)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+    if (!buf)
+        return false;
+
+    StringRef data = (*buf)->getBuffer();
+    if (data.size() < sizeof(StateMagic) || !data.startswith(StringRef(StateMagic, sizeof(StateMagic))))
+        return false;
+
+    DataExtractor DE(data, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+    DataExtractor::Cursor cur(sizeof(StateMagic));
+
+    auto readString = [&]()
+    {
+        uint32_t len = DE.getU32(cur);
+        return DE.getBytes(cur, len).str();
+    };
+
+    auto readStrings = [&](std::vector<std::string> &strs)
+    {
+        uint32_t n = DE.getU32(cur);
+        for (uint32_t i = 0; i < n && cur; i++)
+            strs.push_back(readString());
+    };
+
+    auto readSlots = [&](std::vector<FunctionSlots::Slot> &slots)
+    {
+        uint32_t n = DE.getU32(cur);
+        for (uint32_t i = 0; i < n && cur; i++)
+        {
+            uint32_t local = DE.getU32(cur);
+            uint32_t operand = DE.getU32(cur);
+            slots.push_back(std::make_pair(local, operand));
+        }
+    };
+
+    if (DE.getU32(cur) != Version || readString() != options)
+    {
+        consumeError(cur.takeError());
+        return false;
+    }
+
+    readStrings(sensitiveTypes);
+    readStrings(taintedGlobals);
+    readStrings(taintedConstants);
+
+    uint32_t numFunctions = DE.getU32(cur);
+    for (uint32_t i = 0; i < numFunctions && cur; i++)
+    {
+        std::string name = readString();
+        FunctionState &FS = functions[name];
+
+        StringRef digest = DE.getBytes(cur, sizeof(FS.hash));
+        if (digest.size() == sizeof(FS.hash))
+            std::copy(digest.begin(), digest.end(), FS.hash.Bytes.begin());
+
+        uint8_t flags = DE.getU8(cur);
+        FS.taintedReturn = flags & 1;
+        FS.taintedVarArgs = flags & 2;
+        readSlots(FS.sources);
+        readSlots(FS.tainted);
+        readStrings(FS.callees);
+    }
+
+    if (Error err = cur.takeError())
+    {
+        consumeError(std::move(err));
+        sensitiveTypes.clear();
+        taintedGlobals.clear();
+        taintedConstants.clear();
+        functions.clear();
+        return false;
+    }
+    return true;
+}
+
+bool IncrementalState::store(StringRef path, StringRef options) const
+{
+    // 与分析缓存一样先写临时文件再改名
+    SmallString<128> tmpPath;
+    int fd;
+    if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmpPath))
+        return false;
+
+    {
+        raw_fd_ostream OS(fd, /*shouldClose=*/true);
+        support::endian::Writer W(OS, support::little);
+
+        auto writeString = [&](StringRef str)
+        {
+            W.write<uint32_t>(str.size());
+            OS << str;
+        };
+
+        auto writeStrings = [&](const std::vector<std::string> &strs)
+        {
+            W.write<uint32_t>(strs.size());
+            for (auto &str : strs)
+                writeString(str);
+        };
+
+        auto writeSlots = [&](const std::vector<FunctionSlots::Slot> &slots)
+        {
+            W.write<uint32_t>(slots.size());
+            for (auto &it : slots)
+            {
+                W.write<uint32_t>(it.first);
+                W.write<uint32_t>(it.second);
+            }
+        };
+
+        OS.write(StateMagic, sizeof(StateMagic));
+        W.write<uint32_t>(Version);
+        writeString(options);
+
+        writeStrings(sensitiveTypes);
+        writeStrings(taintedGlobals);
+        writeStrings(taintedConstants);
+
+        W.write<uint32_t>(functions.size());
+        for (auto &it : functions)
+        {
+            const FunctionState &FS = it.getValue();
+            writeString(it.getKey());
+            OS.write(reinterpret_cast<const char *>(FS.hash.Bytes.data()), sizeof(FS.hash));
+            W.write<uint8_t>((FS.taintedReturn ? 1 : 0) | (FS.taintedVarArgs ? 2 : 0));
+            writeSlots(FS.sources);
+            writeSlots(FS.tainted);
+            writeStrings(FS.callees);
+        }
+
+        OS.close();
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            sys::fs::remove(tmpPath);
+            return false;
+        }
+    }
+
+    if (sys::fs::rename(tmpPath, path))
+    {
+        sys::fs::remove(tmpPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,151 @@
+#include "../../include/report_writer.hpp"
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+
+using namespace llvm;
+using namespace COLLATE;
+
+StringRef SourceCache::getLine(StringRef path, unsigned line)
+{
+    auto res = files.try_emplace(path);
+    SourceFile &SF = res.first->second;
+    if (res.second)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> buf =
+            MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buf)
+            return StringRef();
+        SF.buffer = std::move(*buf);
+
+        StringRef data = SF.buffer->getBuffer();
+        SF.lineOffsets.push_back(0);
+        for (size_t pos = data.find('\n'); pos != StringRef::npos; pos = data.find('\n', pos + 1))
+            SF.lineOffsets.push_back(pos + 1);
+    }
+
+    // 行号从1开始
+    if (!SF.buffer || line == 0 || line > SF.lineOffsets.size())
+        return StringRef();
+
+    StringRef data = SF.buffer->getBuffer();
+    size_t begin = SF.lineOffsets[line - 1];
+    size_t end = line < SF.lineOffsets.size() ? SF.lineOffsets[line] - 1 : data.size();
+    return data.slice(begin, end).rtrim('\r');
+}
+
+ReportWriter::ReportWriter(raw_ostream &OS, Format format, const Module &M)
+    : OS(OS), format(format), MST(&M)
+{
+    if (format == JSON)
+    {
+        json.reset(new json::OStream(OS, /*IndentSize=*/2));
+        json->arrayBegin();
+    }
+    else if (format == CSV)
+        OS << "id,kind,function,file,line,source,ir\n";
+}
+
+ReportWriter::~ReportWriter()
+{
+    if (json)
+    {
+        json->arrayEnd();
+        json.reset();
+        OS << "\n";
+    }
+    OS.flush();
+}
+
+void ReportWriter::addInstruction(const Instruction *I)
+{
+    std::string location;
+    unsigned line = 0;
+    if (const DILocation *loc = I->getDebugLoc())
+    {
+        line = loc->getLine();
+        location = loc->getDirectory().str() + "/" + loc->getFilename().str();
+    }
+    addEntry("instruction", I->getFunction()->getName(), location, line, I);
+}
+
+void ReportWriter::addGlobal(const GlobalVariable *G)
+{
+    addEntry("global", StringRef(), StringRef(), 0, G);
+}
+
+void ReportWriter::writeCSVField(StringRef field)
+{
+    if (field.find_first_of(",\"\n\r") == StringRef::npos)
+    {
+        OS << field;
+        return;
+    }
+
+    OS << '"';
+    for (char c : field)
+    {
+        if (c == '"')
+            OS << '"';
+        OS << c;
+    }
+    OS << '"';
+}
+
+void ReportWriter::addEntry(StringRef kind, StringRef function, StringRef file, unsigned line, const Value *V)
+{
+    // 用同一个ModuleSlotTracker打印，避免每条指令都重新给整个函数编号
+    ir.clear();
+    raw_string_ostream irOS(ir);
+    V->print(irOS, MST);
+    irOS.flush();
+
+    StringRef source = line ? sources.getLine(file, line) : StringRef();
+
+    switch (format)
+    {
+    case Text:
+        // 与原来的dumpCrData格式相同
+        if (kind == "instruction")
+        {
+            OS << num << ": ";
+            if (line)
+                OS << source << "(" << file << ":" << line << ")";
+            OS << "\n\t" << ir << " in " << function << "\n";
+        }
+        else
+            OS << num << ": " << ir << "\n";
+        break;
+
+    case JSON:
+    {
+        // 源文件不一定是UTF-8
+        auto str = [](StringRef s) { return json::isUTF8(s) ? s.str() : json::fixUTF8(s); };
+        json->object([&]()
+        {
+            json->attribute("id", (int64_t)num);
+            json->attribute("kind", kind);
+            json->attribute("function", str(function));
+            json->attribute("file", str(file));
+            json->attribute("line", (int64_t)line);
+            json->attribute("source", str(source));
+            json->attribute("ir", str(ir));
+        });
+        break;
+    }
+
+    case CSV:
+        OS << num << "," << kind << ",";
+        writeCSVField(function);
+        OS << ",";
+        writeCSVField(file);
+        OS << "," << line << ",";
+        writeCSVField(source);
+        OS << ",";
+        writeCSVField(ir);
+        OS << "\n";
+        break;
+    }
+
+    num++;
+}
@@ -0,0 +1,72 @@
+#include "../../include/svf_context.hpp"
+
+#include "DDA/ContextDDA.h"
+#include "Graphs/SVFG.h"
+#include "MSSA/SVFGBuilder.h"
+#include "SVF-FE/SVFIRBuilder.h"
+#include "WPA/FlowSensitive.h"
+
+using namespace llvm;
+using namespace SVF;
+using namespace COLLATE;
+
+SVFContext::SVFContext(Module &M)
+{
+    svfModule = LLVMModuleSet::getLLVMModuleSet()->buildSVFModule(M);
+}
+
+SVFContext::~SVFContext()
+{
+    cxtDDA.reset();
+    svfg.reset();
+
+    // ContextDDA内部也使用Andersen的单例，所以最后统一释放
+    FlowSensitive::releaseFSWPA();
+    AndersenWaveDiff::releaseAndersenWaveDiff();
+    if (pag)
+        SVFIR::releaseSVFIR();
+    LLVMModuleSet::releaseLLVMModuleSet();
+}
+
+SVFIR *SVFContext::getPAG()
+{
+    if (!pag)
+    {
+        svfModule->buildSymbolTableInfo();
+
+        SVFIRBuilder builder;
+        pag = builder.build(svfModule);
+    }
+    return pag;
+}
+
+AndersenWaveDiff *SVFContext::getAndersen()
+{
+    if (!andersen)
+        andersen = AndersenWaveDiff::createAndersenWaveDiff(getPAG());
+    return andersen;
+}
+
+PointerAnalysis *SVFContext::getFlowSensitive()
+{
+    if (!fspta)
+        fspta = FlowSensitive::createFSWPA(getPAG());
+    return fspta;
+}
+
+SVFG *SVFContext::getSVFG()
+{
+    if (!svfg)
+    {
+        SVFGBuilder builder;
+        svfg.reset(builder.buildFullSVFG(getAndersen()));
+    }
+    return svfg.get();
+}
+
+PointerAnalysis *SVFContext::createContextDDA(DDAClient *client)
+{
+    cxtDDA.reset(new ContextDDA(getPAG(), client));
+    cxtDDA->initialize();
+    return cxtDDA.get();
+}
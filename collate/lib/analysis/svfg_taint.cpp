@@ -0,0 +1,93 @@
+#include "../../include/svfg_taint.hpp"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/Argument.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instruction.h"
+
+#include <vector>
+
+using namespace llvm;
+using namespace SVF;
+using namespace COLLATE;
+
+Value *SVFGTaintEngine::getTaintedValue(const VFGNode *node) const
+{
+    if (const StoreVFGNode *store = dyn_cast<StoreVFGNode>(node))
+        return const_cast<Instruction *>(store->getInst());
+
+    // 只有这些节点定义顶层变量，其他节点(MSSA的形参/实参、phi等)只表示内存的版本
+    if (!isa<StmtVFGNode>(node) && !isa<PHIVFGNode>(node) && !isa<ArgumentVFGNode>(node) &&
+        !isa<CmpVFGNode>(node) && !isa<BinaryOPVFGNode>(node) && !isa<UnaryOPVFGNode>(node))
+        return nullptr;
+
+    const PAGNode *pNode = svfg->getLHSTopLevPtr(node);
+    if (!pNode || !pNode->hasValue())
+        return nullptr;
+
+    // 函数返回值的节点以函数本身为值，不作为污点
+    Value *V = const_cast<Value *>(pNode->getValue());
+    if (isa<Instruction>(V) || isa<Argument>(V) || isa<GlobalVariable>(V))
+        return V;
+    return nullptr;
+}
+
+bool SVFGTaintEngine::propagatesBackward(const VFGNode *node)
+{
+    // 与规则引擎一致：store的值和指针互相传播，load、getelementptr、bitcast和phi的结果传回操作数，
+    // 形参和实参互相传播。算术和比较在规则引擎中不反向传播
+    return isa<LoadVFGNode>(node) || isa<StoreVFGNode>(node) || isa<GepVFGNode>(node) || isa<CopyVFGNode>(node) ||
+           isa<PHIVFGNode>(node) || isa<ActualParmVFGNode>(node) || isa<FormalParmVFGNode>(node);
+}
+
+void SVFGTaintEngine::propagate(const TaintSet &source, TaintSet &tainted)
+{
+    DenseSet<const VFGNode *> visited;
+    std::vector<const VFGNode *> worklist;
+
+    for (auto it : source)
+    {
+        tainted.insert(it);
+        if (!pag->hasValueNode(it))
+            continue;
+
+        const PAGNode *pNode = pag->getGNode(pag->getValueNode(it));
+        if (!svfg->hasDefSVFGNode(pNode))
+            continue;
+
+        const VFGNode *def = svfg->getDefSVFGNode(pNode);
+        if (visited.insert(def).second)
+            worklist.push_back(def);
+    }
+
+    while (!worklist.empty())
+    {
+        const VFGNode *node = worklist.back();
+        worklist.pop_back();
+
+        if (Value *V = getTaintedValue(node))
+            tainted.insert(V);
+
+        for (VFGNode::const_iterator it = node->OutEdgeBegin(), eit = node->OutEdgeEnd(); it != eit; ++it)
+        {
+            const VFGNode *succ = (*it)->getDstNode();
+            if (visited.insert(succ).second)
+                worklist.push_back(succ);
+        }
+
+        // 只沿直接边(顶层变量)反向到达操作数的定义；经过内存的间接边只前向传播，
+        // 被污染的指针再沿它的出边到达通过它写入的store
+        if (!propagatesBackward(node))
+            continue;
+        for (VFGNode::const_iterator it = node->InEdgeBegin(), eit = node->InEdgeEnd(); it != eit; ++it)
+        {
+            if (!(*it)->isDirectVFGEdge())
+                continue;
+            const VFGNode *pred = (*it)->getSrcNode();
+            if (visited.insert(pred).second)
+                worklist.push_back(pred);
+        }
+    }
+
+    numVisited = visited.size();
+}
@@ -0,0 +1,177 @@
+#include "../../include/manifest.hpp"
+#include "../../../runtime/include/collate_manifest.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <vector>
+
+using namespace llvm;
+using namespace COLLATE;
+
+const char *const ManifestEmitter::SiteMDName = "collate.site";
+
+void ManifestEmitter::addObject(Value *V)
+{
+    if (GlobalVariable *G = dyn_cast<GlobalVariable>(V))
+    {
+        if (G->getValueType()->isSized())
+            globals.insert(G);
+    }
+    else if (AllocaInst *AI = dyn_cast<AllocaInst>(V))
+        stackSlots.insert(AI);
+    else if (CallBase *CB = dyn_cast<CallBase>(V))
+        allocSites.insert(CB);
+}
+
+void ManifestEmitter::tagSites()
+{
+    const DataLayout &DL = M.getDataLayout();
+    LLVMContext &C = M.getContext();
+    Type *i32 = Type::getInt32Ty(C);
+
+    auto tag = [&](Instruction *I, bool isStack, uint64_t size)
+    {
+        I->setMetadata(SiteMDName, MDNode::get(C, ConstantAsMetadata::get(ConstantInt::get(i32, sites.size()))));
+        sites.push_back(Site{isStack, size});
+    };
+
+    for (AllocaInst *AI : stackSlots)
+    {
+        Optional<TypeSize> size = AI->getAllocationSizeInBits(DL);
+        tag(AI, true, size && !size->isScalable() ? size->getFixedSize() / 8 : 0);
+    }
+    for (CallBase *CB : allocSites)
+        tag(CB, false, getAllocSize(CB));
+}
+
+unsigned ManifestEmitter::getSiteID(const Instruction *I)
+{
+    MDNode *MD = I->getMetadata(SiteMDName);
+    if (!MD || MD->getNumOperands() == 0)
+        return ~0U;
+    if (ConstantInt *id = mdconst::dyn_extract<ConstantInt>(MD->getOperand(0)))
+        return id->getZExtValue();
+    return ~0U;
+}
+
+uint64_t ManifestEmitter::getAllocSize(CallBase *CB)
+{
+    Function *F = CB->getCalledFunction();
+    if (!F)
+        return 0;
+
+    auto arg = [&](unsigned i) -> uint64_t
+    {
+        ConstantInt *C = i < CB->arg_size() ? dyn_cast<ConstantInt>(CB->getArgOperand(i)) : nullptr;
+        return C ? C->getZExtValue() : 0;
+    };
+
+    StringRef name = F->getName();
+    if (name == "malloc" || name == "_Znwm" || name == "_Znam")
+        return arg(0);
+    if (name == "calloc")
+        return arg(0) * arg(1);
+    if (name == "realloc" || name == "aligned_alloc" || name == "memalign")
+        return arg(1);
+    return 0;
+}
+
+GlobalVariable *ManifestEmitter::emit()
+{
+    const DataLayout &DL = M.getDataLayout();
+    if (M.getNamedGlobal("__collate_manifest") || DL.getPointerSizeInBits() != 64)
+        return nullptr;
+
+    LLVMContext &C = M.getContext();
+    Type *i32 = Type::getInt32Ty(C);
+    Type *i64 = Type::getInt64Ty(C);
+    Type *i8p = Type::getInt8PtrTy(C);
+
+    // 与collate_manifest.h中的结构体一一对应
+    StructType *headerTy = StructType::get(C, {i32, i32, i32, i32, i32, i32, ArrayType::get(i32, 2)});
+    StructType *globalTy = StructType::get(C, {i8p, i64});
+    StructType *siteTy = StructType::get(C, {i32, i32, i64});
+
+    // 被移动的全局变量记录它在safe data块中的地址，原来的定义不再被引用
+    std::vector<Constant *> globalEntries;
+    for (GlobalVariable *G : globals)
+    {
+        Constant *addr = globalAddrs.lookup(G);
+        globalEntries.push_back(ConstantStruct::get(globalTy, {
+            ConstantExpr::getBitCast(addr ? addr : G, i8p),
+            ConstantInt::get(i64, DL.getTypeAllocSize(G->getValueType()).getFixedSize())}));
+    }
+
+    // 按编号找到对象最终所在的指令：栈对象被移到影子栈后不再是alloca，分配点被改为调用collate_safe_*
+    std::vector<uint32_t> flags(sites.size(), 0);
+    for (auto &F : M)
+    {
+        for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        {
+            unsigned site = getSiteID(&(*I));
+            if (site >= sites.size())
+                continue;
+            if (sites[site].isStack)
+            {
+                if (!isa<AllocaInst>(*I))
+                    flags[site] |= COLLATE_MANIFEST_PLACED;
+            }
+            else if (CallBase *CB = dyn_cast<CallBase>(&(*I)))
+            {
+                Function *callee = CB->getCalledFunction();
+                if (callee && callee->getName().startswith("collate_safe_"))
+                    flags[site] |= COLLATE_MANIFEST_PLACED;
+            }
+        }
+    }
+
+    std::vector<Constant *> stackEntries, allocEntries;
+    for (unsigned site = 0; site < sites.size(); site++)
+    {
+        Constant *entry = ConstantStruct::get(siteTy, {
+            ConstantInt::get(i32, site),
+            ConstantInt::get(i32, flags[site]),
+            ConstantInt::get(i64, sites[site].size)});
+        (sites[site].isStack ? stackEntries : allocEntries).push_back(entry);
+    }
+
+    ArrayType *globalsTy = ArrayType::get(globalTy, globalEntries.size());
+    ArrayType *stacksTy = ArrayType::get(siteTy, stackEntries.size());
+    ArrayType *allocsTy = ArrayType::get(siteTy, allocEntries.size());
+    StructType *blobTy = StructType::get(C, {headerTy, globalsTy, stacksTy, allocsTy});
+    uint64_t size = DL.getTypeAllocSize(blobTy).getFixedSize();
+
+    Constant *header = ConstantStruct::get(headerTy, {
+        ConstantInt::get(i32, COLLATE_MANIFEST_MAGIC),
+        ConstantInt::get(i32, COLLATE_MANIFEST_VERSION),
+        ConstantInt::get(i32, size),
+        ConstantInt::get(i32, globalEntries.size()),
+        ConstantInt::get(i32, stackEntries.size()),
+        ConstantInt::get(i32, allocEntries.size()),
+        ConstantAggregateZero::get(ArrayType::get(i32, 2))});
+
+    Constant *init = ConstantStruct::get(blobTy, {
+        header,
+        ConstantArray::get(globalsTy, globalEntries),
+        ConstantArray::get(stacksTy, stackEntries),
+        ConstantArray::get(allocsTy, allocEntries)});
+
+    GlobalVariable *manifest = new GlobalVariable(M, blobTy, /*isConstant=*/true,
+                                                  GlobalValue::InternalLinkage, init, "__collate_manifest");
+    manifest->setSection(COLLATE_MANIFEST_SECTION);
+    manifest->setAlignment(Align(8));
+
+    // 引用运行时读取清单的函数，链接静态库时runtime/statistics随清单一起被链接进来
+    Function *summarize = cast<Function>(M.getOrInsertFunction("collate_manifest_summarize",
+        Type::getVoidTy(C), i8p).getCallee()->stripPointerCasts());
+    GlobalVariable *ref = new GlobalVariable(M, i8p, /*isConstant=*/true, GlobalValue::InternalLinkage,
+                                             ConstantExpr::getBitCast(summarize, i8p), "__collate_manifest_ref");
+    appendToUsed(M, {manifest, ref});
+    return manifest;
+}
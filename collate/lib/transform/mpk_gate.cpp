@@ -0,0 +1,253 @@
+#include "../../include/mpk_gate.hpp"
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/IRBuilder.h"
+
+using namespace llvm;
+using namespace COLLATE;
+
+// 与runtime/include/collate_mpk.h中collate_gate_open/collate_gate_close的逻辑相同；
+// rdpkru/wrpkru要求ecx为0，wrpkru还要求edx为0
+static const char *const OpenSeq =
+    "cmpl $$0, $0\n\t"
+    "je 1f\n\t"
+    "xorl %ecx, %ecx\n\t"
+    "rdpkru\n\t"
+    "andl $1, %eax\n\t"
+    "xorl %edx, %edx\n\t"
+    "wrpkru\n"
+    "1:";
+
+static const char *const CloseSeq =
+    "cmpl $$0, $0\n\t"
+    "je 1f\n\t"
+    "xorl %ecx, %ecx\n\t"
+    "rdpkru\n\t"
+    "orl $1, %eax\n\t"
+    "xorl %edx, %edx\n\t"
+    "wrpkru\n"
+    "1:";
+
+static const char *const GateConstraints =
+    "*m,*m,~{eax},~{ecx},~{edx},~{dirflag},~{fpsr},~{flags},~{memory}";
+
+MPKGate::MPKGate(Module &M)
+{
+    supported = Triple(M.getTargetTriple()).getArch() == Triple::x86_64;
+    if (!supported)
+        return;
+
+    LLVMContext &C = M.getContext();
+    Type *i32p = Type::getInt32PtrTy(C);
+    FunctionType *gateTy = FunctionType::get(Type::getVoidTy(C), {i32p, i32p}, false);
+    openAsm = InlineAsm::get(gateTy, OpenSeq, GateConstraints, /*hasSideEffects=*/true);
+    closeAsm = InlineAsm::get(gateTy, CloseSeq, GateConstraints, /*hasSideEffects=*/true);
+
+    enabled = getRuntimeVar(M, "collate_mpk_enabled");
+    openMask = getRuntimeVar(M, "collate_pkru_open_mask");
+    closeMask = getRuntimeVar(M, "collate_pkru_close_mask");
+}
+
+GlobalVariable *MPKGate::getRuntimeVar(Module &M, StringRef name)
+{
+    Type *i32 = Type::getInt32Ty(M.getContext());
+    if (GlobalVariable *G = M.getNamedGlobal(name))
+        return G;
+    return new GlobalVariable(M, i32, /*isConstant=*/false, GlobalValue::ExternalLinkage, nullptr, name);
+}
+
+void MPKGate::setElementTypes(CallInst *CI)
+{
+    // 间接内存操作数("*m")需要标明指向的类型
+    Type *i32 = Type::getInt32Ty(CI->getContext());
+    for (unsigned i = 0; i < CI->arg_size(); i++)
+        CI->addParamAttr(i, Attribute::get(CI->getContext(), Attribute::ElementType, i32));
+}
+
+void MPKGate::emitOpen(Instruction *insertBefore)
+{
+    IRBuilder<> IRB(insertBefore);
+    setElementTypes(IRB.CreateCall(openAsm, {enabled, openMask}));
+    numGates++;
+}
+
+void MPKGate::emitClose(Instruction *insertBefore)
+{
+    IRBuilder<> IRB(insertBefore);
+    setElementTypes(IRB.CreateCall(closeAsm, {enabled, closeMask}));
+    numGates++;
+}
+
+void MPKGate::insertOpen(Instruction *I)
+{
+    emitOpen(I);
+}
+
+void MPKGate::insertClose(Instruction *I)
+{
+    // invoke在两个后继的开头关闭；关闭是幂等的，后继有其他前驱时多出的关闭不影响正确性。
+    // 异常的后继只处理landingpad，funclet中的inline asm需要额外的bundle
+    if (InvokeInst *II = dyn_cast<InvokeInst>(I))
+    {
+        emitClose(&*II->getNormalDest()->getFirstInsertionPt());
+        BasicBlock *unwind = II->getUnwindDest();
+        if (isa<LandingPadInst>(unwind->getFirstNonPHI()))
+            emitClose(&*unwind->getFirstInsertionPt());
+        return;
+    }
+
+    assert(!I->isTerminator() && "close gate after a terminator");
+    emitClose(I->getNextNode());
+}
+
+bool MPKGate::isOpen(const Instruction *I) const
+{
+    const CallInst *CI = dyn_cast<CallInst>(I);
+    return CI && CI->getCalledOperand() == openAsm;
+}
+
+bool MPKGate::isClose(const Instruction *I) const
+{
+    const CallInst *CI = dyn_cast<CallInst>(I);
+    return CI && CI->getCalledOperand() == closeAsm;
+}
+
+bool MPKGate::isSafe(const Instruction *I, const SmallPtrSetImpl<Instruction *> &trusted) const
+{
+    // 开关序列本身带有内存clobber，单独识别
+    if (isOpen(I) || isClose(I))
+        return true;
+    // 可能抛出异常的指令(包括readnone的调用)会经过开关之外的展开边离开，
+    // 外提或合并之后safe region在异常路径上保持打开
+    if (I->mayThrow())
+        return false;
+    return !I->mayReadOrWriteMemory() || trusted.count(const_cast<Instruction *>(I));
+}
+
+void MPKGate::erase(Instruction *gate)
+{
+    gate->eraseFromParent();
+    numRemoved++;
+}
+
+bool MPKGate::hoistLoop(Loop *L, const SmallPtrSetImpl<Instruction *> &trusted)
+{
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!preheader || !L->hasDedicatedExits())
+        return false;
+
+    SmallVector<Instruction *, 16> gates;
+    for (BasicBlock *BB : L->blocks())
+    {
+        for (Instruction &I : *BB)
+        {
+            if (!isSafe(&I, trusted))
+                return false;
+            if (isOpen(&I) || isClose(&I))
+                gates.push_back(&I);
+        }
+    }
+    if (gates.empty())
+        return false;
+
+    SmallVector<BasicBlock *, 4> exits;
+    L->getUniqueExitBlocks(exits);
+    for (BasicBlock *exit : exits)
+    {
+        if (exit->isEHPad())
+            return false;
+    }
+
+    for (Instruction *gate : gates)
+        erase(gate);
+    emitOpen(preheader->getTerminator());
+    for (BasicBlock *exit : exits)
+        emitClose(&*exit->getFirstInsertionPt());
+    return true;
+}
+
+void MPKGate::coalesceInBlock(BasicBlock &BB, const SmallPtrSetImpl<Instruction *> &trusted)
+{
+    SmallVector<Instruction *, 16> dead;
+    Instruction *lastClose = nullptr;
+    for (Instruction &I : BB)
+    {
+        if (isClose(&I))
+            lastClose = &I;
+        else if (isOpen(&I))
+        {
+            if (lastClose)
+            {
+                dead.push_back(lastClose);
+                dead.push_back(&I);
+            }
+            lastClose = nullptr;
+        }
+        else if (!isSafe(&I, trusted))
+            lastClose = nullptr;
+    }
+
+    for (Instruction *gate : dead)
+        erase(gate);
+}
+
+void MPKGate::coalesceAcrossBlocks(Function &F, const SmallPtrSetImpl<Instruction *> &trusted)
+{
+    SmallVector<Instruction *, 16> dead;
+    for (BasicBlock &BB : F)
+    {
+        // 块末尾的close，之后到terminator只有安全的指令
+        Instruction *close = nullptr;
+        for (auto it = BB.rbegin(), ie = BB.rend(); it != ie; ++it)
+        {
+            if (isClose(&*it))
+                close = &*it;
+            if (close || isOpen(&*it) || !isSafe(&*it, trusted))
+                break;
+        }
+
+        Instruction *term = BB.getTerminator();
+        if (!close || !term || term->getNumSuccessors() == 0)
+            continue;
+
+        // 每个后继只能从这里进入，并且在其他访问之前先打开
+        SmallVector<Instruction *, 4> opens;
+        for (BasicBlock *succ : successors(&BB))
+        {
+            Instruction *open = nullptr;
+            if (succ->getSinglePredecessor() == &BB)
+            {
+                for (Instruction &I : *succ)
+                {
+                    if (isOpen(&I))
+                        open = &I;
+                    if (open || isClose(&I) || !isSafe(&I, trusted))
+                        break;
+                }
+            }
+            if (!open)
+                break;
+            opens.push_back(open);
+        }
+        if (opens.size() != term->getNumSuccessors())
+            continue;
+
+        dead.push_back(close);
+        dead.append(opens.begin(), opens.end());
+    }
+
+    for (Instruction *gate : dead)
+        erase(gate);
+}
+
+void MPKGate::optimize(Function &F, const SmallPtrSetImpl<Instruction *> &trusted, LoopInfo &LI)
+{
+    // 内层循环先外提，外层循环体中就只剩内层preheader和出口的开关
+    SmallVector<Loop *, 8> loops = LI.getLoopsInPreorder();
+    for (auto it = loops.rbegin(), ie = loops.rend(); it != ie; ++it)
+        hoistLoop(*it, trusted);
+
+    for (BasicBlock &BB : F)
+        coalesceInBlock(BB, trusted);
+    coalesceAcrossBlocks(F, trusted);
+}
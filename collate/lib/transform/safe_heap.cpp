@@ -0,0 +1,74 @@
+#include "../../include/safe_heap.hpp"
+#include "../../include/manifest.hpp"
+
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+
+#include <utility>
+
+using namespace llvm;
+using namespace COLLATE;
+
+// 名字与runtime/include/collate_alloc.h一致
+static StringRef getSafeAllocator(StringRef name)
+{
+    return StringSwitch<StringRef>(name)
+        .Case("malloc", "collate_safe_malloc")
+        .Case("calloc", "collate_safe_calloc")
+        .Case("realloc", "collate_safe_realloc")
+        .Cases("aligned_alloc", "memalign", "collate_safe_aligned_alloc")
+        .Cases("_Znwm", "_Znam", "collate_safe_new")
+        .Default("");
+}
+
+static const std::pair<const char *, const char *> Deallocators[] = {
+    {"free", "collate_free"},
+    {"realloc", "collate_realloc"},
+    {"_ZdlPv", "collate_delete"},
+    {"_ZdaPv", "collate_delete_array"},
+    {"_ZdlPvm", "collate_delete_sized"},
+    {"_ZdaPvm", "collate_delete_array_sized"},
+};
+
+unsigned SafeHeap::redirectAllocSites()
+{
+    unsigned n = 0;
+    for (auto &F : M)
+    {
+        for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        {
+            CallBase *CB = dyn_cast<CallBase>(&(*I));
+            if (!CB || ManifestEmitter::getSiteID(CB) == ~0U)
+                continue;
+
+            Function *callee = CB->getCalledFunction();
+            StringRef safe = callee ? getSafeAllocator(callee->getName()) : "";
+            if (safe.empty())
+                continue;
+
+            // 参数与原函数相同，使用调用点的函数类型
+            CB->setCalledFunction(M.getOrInsertFunction(safe, CB->getFunctionType()));
+            n++;
+        }
+    }
+    return n;
+}
+
+unsigned SafeHeap::redirectDeallocations()
+{
+    unsigned n = 0;
+    for (auto &it : Deallocators)
+    {
+        Function *F = M.getFunction(it.first);
+        if (!F || !F->isDeclaration() || F->use_empty())
+            continue;
+
+        FunctionCallee wrapper = M.getOrInsertFunction(it.second, F->getFunctionType());
+        // 原来的声明留在模块中，分析阶段的结构可能还引用着它
+        F->replaceAllUsesWith(ConstantExpr::getBitCast(cast<Constant>(wrapper.getCallee()), F->getType()));
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,316 @@
+#include "../../include/safe_placement.hpp"
+#include "../../include/manifest.hpp"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+using namespace COLLATE;
+
+// 与runtime/include/collate_shadow_stack.h一致
+const char *const SafePlacement::SectionName = "collate_safe_data";
+static const uint64_t PageSize = 4096;
+static const uint64_t MinFrameAlign = 16;
+
+bool SafePlacement::canRelocate(GlobalVariable *G)
+{
+    // 只移动本模块中确定的定义；常量已经在只读段中。
+    // 有comdat或可被替换的定义在链接时可能换成别的模块的版本，别名无法表达
+    if (G->isDeclaration() || G->isConstant() || G->isThreadLocal() || G->hasSection() ||
+        G->hasComdat() || G->isInterposable() || G->hasCommonLinkage() || G->isExternallyInitialized())
+        return false;
+    if (G->getAlign() && G->getAlign()->value() > PageSize)
+        return false;
+    return G->getValueType()->isSized();
+}
+
+unsigned SafePlacement::relocateGlobals(ArrayRef<GlobalVariable *> globals)
+{
+    const DataLayout &DL = M.getDataLayout();
+    LLVMContext &C = M.getContext();
+
+    // llvm.used中的全局变量必须保持为独立的定义
+    SmallVector<GlobalValue *, 8> usedVec;
+    collectUsedGlobalVariables(M, usedVec, /*CompilerUsed=*/false);
+    collectUsedGlobalVariables(M, usedVec, /*CompilerUsed=*/true);
+    SmallPtrSet<GlobalValue *, 8> used(usedVec.begin(), usedVec.end());
+
+    // 每个全局变量在块中保持它原来的对齐(显式的和首选的中较大的)，已有的访问可能依赖它，
+    // 例如按16字节对齐的向量load。按对齐从大到小排列，减少块中的填充
+    auto alignOf = [&](GlobalVariable *G)
+    {
+        return std::max(G->getAlign().valueOrOne(), DL.getPreferredAlign(G));
+    };
+    std::vector<GlobalVariable *> moved;
+    for (GlobalVariable *G : globals)
+        if (!used.count(G) && canRelocate(G))
+            moved.push_back(G);
+    if (moved.empty())
+        return 0;
+    std::stable_sort(moved.begin(), moved.end(), [&](GlobalVariable *a, GlobalVariable *b)
+    {
+        return alignOf(a) > alignOf(b);
+    });
+
+    // 紧凑的结构体，字段的位置由显式的[N x i8]填充决定，不依赖类型的ABI对齐；
+    // 末尾补齐到整页，块之间不与其他数据共享页
+    Type *i8 = Type::getInt8Ty(C);
+    std::vector<Type *> fields;
+    std::vector<Constant *> inits;
+    std::vector<unsigned> fieldIndex;
+    uint64_t size = 0;
+    auto addPadding = [&](uint64_t bytes)
+    {
+        if (!bytes)
+            return;
+        fields.push_back(ArrayType::get(i8, bytes));
+        inits.push_back(ConstantAggregateZero::get(fields.back()));
+        size += bytes;
+    };
+    for (GlobalVariable *G : moved)
+    {
+        addPadding(alignTo(size, alignOf(G)) - size);
+        fieldIndex.push_back(fields.size());
+        fields.push_back(G->getValueType());
+        inits.push_back(G->getInitializer());
+        size += DL.getTypeAllocSize(G->getValueType()).getFixedSize();
+    }
+    addPadding(alignTo(size, PageSize) - size);
+    StructType *blockTy = StructType::get(C, fields, /*isPacked=*/true);
+
+    GlobalVariable *block = new GlobalVariable(M, blockTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+                                               ConstantStruct::get(blockTy, inits), "__collate_safe_data");
+    block->setSection(SectionName);
+    block->setAlignment(Align(PageSize));
+
+    Type *i32 = Type::getInt32Ty(C);
+    for (unsigned i = 0; i < moved.size(); i++)
+    {
+        GlobalVariable *G = moved[i];
+        Constant *field = ConstantExpr::getInBoundsGetElementPtr(blockTy, block,
+            ArrayRef<Constant *>({ConstantInt::get(i32, 0), ConstantInt::get(i32, fieldIndex[i])}));
+
+        // 模块外可见的符号保留为别名，模块内的使用直接指向字段。
+        // 别名在IR中不能带对齐，字段的对齐由上面的填充和按页对齐的块保证
+        Constant *repl = field;
+        if (!G->hasLocalLinkage())
+        {
+            GlobalAlias *GA = GlobalAlias::create(G->getValueType(), G->getAddressSpace(), G->getLinkage(), "", field, &M);
+            GA->takeName(G);
+            GA->setVisibility(G->getVisibility());
+            GA->setDLLStorageClass(G->getDLLStorageClass());
+            GA->setDSOLocal(G->isDSOLocal());
+            repl = GA;
+        }
+
+        // 原来的定义不再被使用，留给后续的优化删除；分析阶段的结构可能还引用着它
+        G->replaceAllUsesWith(ConstantExpr::getBitCast(repl, G->getType()));
+        relocated[G] = repl;
+        G->setLinkage(GlobalValue::InternalLinkage);
+    }
+    return moved.size();
+}
+
+void SafePlacement::insertProtectCall()
+{
+    Function *F = M.getFunction("main");
+    if (!F || F->isDeclaration())
+        return;
+
+    // 放在main开始时：静态构造函数已经完成了对这些全局变量的初始化
+    IRBuilder<> IRB(&*F->getEntryBlock().getFirstInsertionPt());
+    FunctionCallee protect = M.getOrInsertFunction("collate_protect_safe_data", Type::getVoidTy(M.getContext()));
+    IRB.CreateCall(protect);
+}
+
+GlobalVariable *SafePlacement::getShadowStackPointer()
+{
+    Type *i8p = Type::getInt8PtrTy(M.getContext());
+    if (GlobalVariable *G = M.getNamedGlobal("collate_shadow_sp"))
+        return G;
+    GlobalVariable *G = new GlobalVariable(M, i8p, /*isConstant=*/false, GlobalValue::ExternalLinkage,
+                                           nullptr, "collate_shadow_sp");
+    // 运行时以initial-exec模型定义，入口的读取是一条相对线程指针的load，不经过__tls_get_addr
+    G->setThreadLocalMode(GlobalVariable::InitialExecTLSModel);
+    return G;
+}
+
+bool SafePlacement::canRelocate(Function &F)
+{
+    // setjmp返回第二次时跳过了出口的恢复；musttail调用之前不能插入恢复
+    if (F.callsFunctionThatReturnsTwice())
+        return false;
+    for (auto &BB : F)
+        if (BB.getTerminatingMustTailCall())
+            return false;
+    return true;
+}
+
+unsigned SafePlacement::relocateAllocas(Function &F, ArrayRef<AllocaInst *> allocas)
+{
+    if (allocas.empty() || !canRelocate(F))
+        return 0;
+
+    const DataLayout &DL = M.getDataLayout();
+    LLVMContext &C = M.getContext();
+
+    // 只处理入口块中大小固定的alloca，在帧中按声明顺序排列
+    std::vector<std::pair<AllocaInst *, uint64_t>> slots;
+    uint64_t frameSize = 0, frameAlign = MinFrameAlign;
+    for (AllocaInst *AI : allocas)
+    {
+        if (AI->getFunction() != &F || !AI->isStaticAlloca() || AI->getParent() != &F.getEntryBlock())
+            continue;
+
+        Optional<TypeSize> bits = AI->getAllocationSizeInBits(DL);
+        if (!bits || bits->isScalable() || AI->getAlign().value() > PageSize)
+            continue;
+
+        uint64_t align = AI->getAlign().value();
+        frameSize = alignTo(frameSize, align);
+        slots.push_back(std::make_pair(AI, frameSize));
+        frameSize += alignTo(bits->getFixedSize(), 8) / 8;
+        frameAlign = std::max(frameAlign, align);
+    }
+    if (slots.empty())
+        return 0;
+    frameSize = alignTo(frameSize, frameAlign);
+
+    // 入口：读取影子栈指针，线程第一次使用时由运行时分配影子栈。
+    // 入口块在第一条非alloca指令处被拆分，之后的静态alloca会落到后继块中成为动态alloca，
+    // 先把它们移到拆分点之前；它们只以常量为操作数，提前不改变语义
+    BasicBlock &entry = F.getEntryBlock();
+    BasicBlock::iterator it = entry.begin();
+    while (isa<AllocaInst>(*it) || isa<DbgInfoIntrinsic>(*it))
+        ++it;
+    SmallVector<AllocaInst *, 8> lateAllocas;
+    for (BasicBlock::iterator I = it, E = entry.end(); I != E; ++I)
+        if (AllocaInst *AI = dyn_cast<AllocaInst>(&*I))
+            if (AI->isStaticAlloca())
+                lateAllocas.push_back(AI);
+    for (AllocaInst *AI : lateAllocas)
+        AI->moveBefore(&*it);
+
+    GlobalVariable *spVar = getShadowStackPointer();
+    Type *i8p = Type::getInt8PtrTy(C);
+    Type *intPtr = DL.getIntPtrType(C);
+
+    IRBuilder<> IRB(&*it);
+    LoadInst *sp = IRB.CreateLoad(i8p, spVar, "collate.sp");
+    Value *isNull = IRB.CreateIsNull(sp);
+    Instruction *attachTerm = SplitBlockAndInsertIfThen(isNull, &*IRB.GetInsertPoint(), /*Unreachable=*/false,
+                                                        MDBuilder(C).createBranchWeights(1, 1 << 20));
+    BasicBlock *body = attachTerm->getSuccessor(0);
+
+    IRB.SetInsertPoint(attachTerm);
+    FunctionCallee attach = M.getOrInsertFunction("collate_shadow_stack_attach", i8p);
+    Value *fresh = IRB.CreateCall(attach);
+
+    IRB.SetInsertPoint(&*body->getFirstInsertionPt());
+    PHINode *base = IRB.CreatePHI(i8p, 2, "collate.sp.base");
+    base->addIncoming(sp, sp->getParent());
+    base->addIncoming(fresh, attachTerm->getParent());
+
+    // 影子栈向低地址增长，帧的起点按帧内最大的对齐向下对齐
+    Value *top = IRB.CreatePtrToInt(base, intPtr);
+    Value *frameInt = IRB.CreateAnd(IRB.CreateSub(top, ConstantInt::get(intPtr, frameSize)),
+                                    ConstantInt::get(intPtr, ~(frameAlign - 1)));
+    Value *frame = IRB.CreateIntToPtr(frameInt, i8p, "collate.frame");
+    IRB.CreateStore(frame, spVar);
+
+    for (auto &slot : slots)
+    {
+        AllocaInst *AI = slot.first;
+
+        // 生命周期标记只能用于alloca，移走后删除
+        SmallVector<Instruction *, 4> markers;
+        for (User *U : AI->users())
+        {
+            Instruction *I = dyn_cast<Instruction>(U);
+            if (I && I->isLifetimeStartOrEnd())
+                markers.push_back(I);
+            else if (BitCastInst *BC = dyn_cast<BitCastInst>(U))
+                for (User *UU : BC->users())
+                    if (cast<Instruction>(UU)->isLifetimeStartOrEnd())
+                        markers.push_back(cast<Instruction>(UU));
+        }
+        for (Instruction *I : markers)
+            I->eraseFromParent();
+
+        Value *addr = IRB.CreateInBoundsGEP(Type::getInt8Ty(C), frame, ConstantInt::get(intPtr, slot.second));
+        Value *shadow = IRB.CreateBitCast(addr, AI->getType(), AI->getName() + ".shadow");
+        // 清单按!collate.site编号找到移走后的对象
+        if (Instruction *I = dyn_cast<Instruction>(shadow))
+            I->copyMetadata(*AI, {C.getMDKindID(ManifestEmitter::SiteMDName)});
+        AI->replaceAllUsesWith(shadow);
+        // O0时没有后续的优化删除它，留下的alloca仍会占用本地栈帧
+        AI->eraseFromParent();
+    }
+
+    // 每个出口恢复进入函数时的影子栈指针；
+    // 异常到达landingpad时，抛出异常的被调函数没有经过它们的出口，指针回到本函数的帧
+    for (auto &BB : F)
+    {
+        Instruction *term = BB.getTerminator();
+        if (isa<ReturnInst>(term) || isa<ResumeInst>(term))
+            new StoreInst(base, spVar, term);
+    }
+    restoreAtEHPads(F, frame);
+    return slots.size();
+}
+
+bool SafePlacement::restoreOnUnwind(Function &F)
+{
+    if (F.isDeclaration() || !F.hasPersonalityFn())
+        return false;
+
+    bool hasPad = false;
+    for (auto &BB : F)
+        hasPad |= BB.isEHPad();
+    if (!hasPad)
+        return false;
+
+    // 本函数没有影子栈上的对象，只需要记住进入时的指针。
+    // 线程此时可能还没有影子栈(指针为NULL)，由运行时在landingpad决定恢复到哪里
+    LLVMContext &C = M.getContext();
+    Type *i8p = Type::getInt8PtrTy(C);
+    IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+    LoadInst *sp = IRB.CreateLoad(i8p, getShadowStackPointer(), "collate.sp");
+
+    FunctionCallee unwind = M.getOrInsertFunction("collate_shadow_stack_unwind", Type::getVoidTy(C), i8p);
+    for (auto &BB : F)
+    {
+        if (!BB.isEHPad() || isa<CatchSwitchInst>(BB.getFirstNonPHI()))
+            continue;
+        // funclet中的调用需要带上所在的pad
+        SmallVector<OperandBundleDef, 1> bundles;
+        if (FuncletPadInst *pad = dyn_cast<FuncletPadInst>(BB.getFirstNonPHI()))
+            bundles.emplace_back("funclet", pad);
+        CallInst::Create(unwind, {sp}, bundles, "", &*BB.getFirstInsertionPt());
+    }
+    return true;
+}
+
+void SafePlacement::restoreAtEHPads(Function &F, Value *sp)
+{
+    GlobalVariable *spVar = getShadowStackPointer();
+    for (auto &BB : F)
+    {
+        // catchswitch所在的块不能插入其他指令，由它的各个catchpad恢复
+        if (!BB.isEHPad() || isa<CatchSwitchInst>(BB.getFirstNonPHI()))
+            continue;
+        new StoreInst(sp, spVar, &*BB.getFirstInsertionPt());
+    }
+}
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include "../include/collate_alloc.h"
+#include "../include/collate_mpk.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * 布局：启动时保留一整块地址空间(默认16GiB，环境变量COLLATE_SAFE_HEAP_SIZE可以修改)，
+ * 以MAP_NORESERVE映射并整体标记为COLLATE的pkey，物理页在第一次写入时才分配，不需要逐块提交。
+ * 区域按64KiB分成slab，每个slab只服务一个大小类；超过最大大小类的分配占用若干个连续的slab(span)。
+ *
+ * 分配器的元数据(每个slab的用途、空闲对象的指针)全部放在safe region之外，
+ * malloc/free的路径上不读写受保护的内存，也就不需要写PKRU；只有calloc清零和realloc复制时打开访问。
+ *
+ * 快路径只访问线程本地的缓存：每个大小类一个空闲指针栈和一段正在切分的slab，不加锁。
+ * 本地栈满时把一批指针放入全局的depot，为空时先从depot取一批，再切分新的slab；
+ * depot按大小类加自旋锁，每次操作一批对象，不在快路径上。
+ * 线程退出时本地缓存还给depot，正在切分的slab剩下的部分不再使用。
+ */
+
+#define SLAB_SHIFT 16
+#define SLAB_SIZE (1UL << SLAB_SHIFT)
+#define NUM_CLASSES 40
+#define MAX_SMALL 32768
+#define BATCH 32
+#define CACHE_SLOTS (2 * BATCH)
+#define DEFAULT_HEAP_SIZE (16UL << 30)
+#define MIN_HEAP_SIZE (64UL << 20)
+#define RELEASE_SLABS 16 /* 不小于这个大小的span释放时归还物理页 */
+
+#define SLAB_LARGE 0x80000000u
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+struct batch
+{
+    struct batch *next;
+    void *ptrs[BATCH];
+};
+
+struct class_cache
+{
+    uint32_t count;
+    void *slots[CACHE_SLOTS];
+};
+
+struct thread_cache
+{
+    char *bump[NUM_CLASSES];
+    char *bump_end[NUM_CLASSES];
+    struct batch *spare; /* 取空的batch留给下一次flush */
+    struct class_cache classes[NUM_CLASSES];
+};
+
+struct spinlock
+{
+    volatile char locked;
+};
+
+struct depot
+{
+    struct spinlock lock;
+    struct batch *batches;
+};
+
+struct span
+{
+    struct span *next;
+    size_t first;
+    size_t count;
+};
+
+static __thread struct thread_cache *cache __attribute__((tls_model("initial-exec")));
+
+static char *heap_base;
+static char *heap_end;
+static uint32_t *slab_info; /* 每个slab：0未使用，c+1为大小类c，SLAB_LARGE|n为n个slab的span的第一个 */
+static size_t num_slabs;
+static size_t next_slab;
+
+static struct depot depots[NUM_CLASSES];
+static struct spinlock large_lock;
+static struct span *large_free;
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static inline void spin_lock(struct spinlock *l)
+{
+    while (__atomic_test_and_set(&l->locked, __ATOMIC_ACQUIRE))
+        __builtin_ia32_pause();
+}
+
+static inline void spin_unlock(struct spinlock *l)
+{
+    __atomic_clear(&l->locked, __ATOMIC_RELEASE);
+}
+
+/* 128字节以内按16字节递增，之后每次翻倍分成4档 */
+static inline unsigned size_class(size_t n)
+{
+    if (n <= 128)
+        return n ? (unsigned)((n - 1) >> 4) : 0;
+    unsigned shift = 63 - __builtin_clzl(n - 1);
+    return 8 + (shift - 7) * 4 + (unsigned)((n - 1) >> (shift - 2)) - 4;
+}
+
+static inline size_t class_size(unsigned c)
+{
+    if (c < 8)
+        return (c + 1) * 16;
+    unsigned group = (c - 8) / 4, step = (c - 8) % 4;
+    return (size_t)(5 + step) << (group + 5);
+}
+
+static inline size_t slab_index(const void *ptr)
+{
+    return ((const char *)ptr - heap_base) >> SLAB_SHIFT;
+}
+
+static void release_thread_cache(void *arg);
+
+static size_t heap_size_from_env(void)
+{
+    const char *env = getenv("COLLATE_SAFE_HEAP_SIZE");
+    if (!env || !*env)
+        return DEFAULT_HEAP_SIZE;
+
+    char *end;
+    unsigned long long size = strtoull(env, &end, 0);
+    switch (*end)
+    {
+    case 'g': case 'G': size <<= 30; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'k': case 'K': size <<= 10; break;
+    default: break;
+    }
+    return size < MIN_HEAP_SIZE ? MIN_HEAP_SIZE : (size_t)size;
+}
+
+static void heap_init(void)
+{
+    collate_mpk_init();
+    pthread_key_create(&cache_key, release_thread_cache);
+
+    /* 多保留一个slab用于对齐；严格的overcommit策略下大块的保留可能失败，逐步减半重试 */
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    size_t size = heap_size_from_env();
+    void *base = MAP_FAILED;
+    for (; size >= MIN_HEAP_SIZE; size /= 2)
+    {
+        base = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base != MAP_FAILED)
+            break;
+    }
+    if (base == MAP_FAILED)
+        return;
+
+    char *begin = (char *)(((uintptr_t)base + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+    size_t slabs = size >> SLAB_SHIFT;
+    void *info = mmap(NULL, slabs * sizeof(uint32_t), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (info == MAP_FAILED || collate_mpk_protect(begin, slabs << SLAB_SHIFT, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(base, size + SLAB_SIZE);
+        if (info != MAP_FAILED)
+            munmap(info, slabs * sizeof(uint32_t));
+        return;
+    }
+
+    slab_info = (uint32_t *)info;
+    num_slabs = slabs;
+    heap_end = begin + (slabs << SLAB_SHIFT);
+    __atomic_store_n(&heap_base, begin, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor(102))) static void collate_safe_heap_init(void)
+{
+    pthread_once(&heap_once, heap_init);
+}
+
+static int heap_ready(void)
+{
+    if (likely(__atomic_load_n(&heap_base, __ATOMIC_ACQUIRE) != NULL))
+        return 1;
+    pthread_once(&heap_once, heap_init);
+    return heap_base != NULL;
+}
+
+int collate_safe_heap_contains(const void *ptr)
+{
+    return (const char *)ptr >= heap_base && (const char *)ptr < heap_end;
+}
+
+/* 从全局的slab中取出连续n个，没有更多空间时返回NULL */
+static char *take_slabs(size_t n, uint32_t info)
+{
+    size_t idx = __atomic_fetch_add(&next_slab, n, __ATOMIC_RELAXED);
+    if (idx + n > num_slabs || idx + n < idx)
+        return NULL;
+    slab_info[idx] = info;
+    return heap_base + (idx << SLAB_SHIFT);
+}
+
+static struct thread_cache *create_thread_cache(void)
+{
+    if (!heap_ready())
+        return NULL;
+
+    /* 缓存本身用libc分配，线程创建时不需要额外的映射 */
+    struct thread_cache *tc = (struct thread_cache *)calloc(1, sizeof(struct thread_cache));
+    if (!tc)
+        return NULL;
+    cache = tc;
+    pthread_setspecific(cache_key, tc);
+    return tc;
+}
+
+/* 把栈顶的一批指针放入depot */
+static void flush_batch(struct thread_cache *tc, unsigned c)
+{
+    struct class_cache *cc = &tc->classes[c];
+    struct batch *b = tc->spare ? tc->spare : (struct batch *)malloc(sizeof(struct batch));
+    if (!b)
+        return; /* 留在本地，下一次再试 */
+    tc->spare = NULL;
+
+    cc->count -= BATCH;
+    memcpy(b->ptrs, &cc->slots[cc->count], sizeof(b->ptrs));
+
+    spin_lock(&depots[c].lock);
+    b->next = depots[c].batches;
+    depots[c].batches = b;
+    spin_unlock(&depots[c].lock);
+}
+
+static void release_thread_cache(void *arg)
+{
+    struct thread_cache *tc = (struct thread_cache *)arg;
+    for (unsigned c = 0; c < NUM_CLASSES; c++)
+    {
+        struct class_cache *cc = &tc->classes[c];
+        while (cc->count >= BATCH)
+            flush_batch(tc, c);
+
+        /* 不足一批的部分用当前slab中尚未切分的对象补足，仍然不够就放弃这些对象 */
+        while (cc->count > 0 && cc->count < BATCH && tc->bump[c] &&
+               tc->bump[c] + class_size(c) <= tc->bump_end[c])
+        {
+            cc->slots[cc->count++] = tc->bump[c];
+            tc->bump[c] += class_size(c);
+        }
+        if (cc->count == BATCH)
+            flush_batch(tc, c);
+    }
+    free(tc->spare);
+    free(tc);
+    cache = NULL;
+}
+
+static void *refill(struct thread_cache *tc, unsigned c)
+{
+    struct class_cache *cc = &tc->classes[c];
+
+    struct batch *b = NULL;
+    if (__atomic_load_n(&depots[c].batches, __ATOMIC_RELAXED))
+    {
+        spin_lock(&depots[c].lock);
+        b = depots[c].batches;
+        if (b)
+            depots[c].batches = b->next;
+        spin_unlock(&depots[c].lock);
+    }
+    if (b)
+    {
+        memcpy(cc->slots, b->ptrs, sizeof(b->ptrs));
+        cc->count = BATCH - 1;
+        if (tc->spare)
+            free(b);
+        else
+            tc->spare = b;
+        return cc->slots[BATCH - 1];
+    }
+
+    size_t size = class_size(c);
+    char *slab = take_slabs(1, c + 1);
+    if (!slab)
+        return NULL;
+    tc->bump[c] = slab + size;
+    tc->bump_end[c] = slab + SLAB_SIZE;
+    return slab;
+}
+
+static void *alloc_large(size_t size)
+{
+    size_t n = (size + SLAB_SIZE - 1) >> SLAB_SHIFT;
+    if (n == 0 || n >= SLAB_LARGE || !heap_ready())
+        return NULL;
+
+    /* 先找一个足够大的空闲span，多余的部分留在链表中 */
+    char *ptr = NULL;
+    struct span *used = NULL;
+    spin_lock(&large_lock);
+    for (struct span **pp = &large_free; *pp; pp = &(*pp)->next)
+    {
+        struct span *s = *pp;
+        if (s->count < n)
+            continue;
+
+        ptr = heap_base + (s->first << SLAB_SHIFT);
+        slab_info[s->first] = SLAB_LARGE | (uint32_t)n;
+        if (s->count == n)
+        {
+            *pp = s->next;
+            used = s;
+        }
+        else
+        {
+            s->first += n;
+            s->count -= n;
+        }
+        break;
+    }
+    spin_unlock(&large_lock);
+
+    free(used);
+    return ptr ? ptr : take_slabs(n, SLAB_LARGE | (uint32_t)n);
+}
+
+static void free_large(const void *ptr, uint32_t info)
+{
+    struct span *s = (struct span *)malloc(sizeof(struct span));
+    size_t idx = slab_index(ptr);
+    size_t n = info & ~SLAB_LARGE;
+
+    /* 清除slab_info，重复释放时abort；较大的span归还物理页，映射和pkey保持不变 */
+    slab_info[idx] = 0;
+    if (n >= RELEASE_SLABS)
+        madvise((void *)ptr, n << SLAB_SHIFT, MADV_DONTNEED);
+    if (!s)
+        return; /* 放弃这段地址空间 */
+
+    s->first = idx;
+    s->count = n;
+    spin_lock(&large_lock);
+    s->next = large_free;
+    large_free = s;
+    spin_unlock(&large_lock);
+}
+
+void *collate_safe_malloc(size_t size)
+{
+    if (unlikely(size > MAX_SMALL))
+    {
+        void *ptr = alloc_large(size);
+        if (!ptr)
+            errno = ENOMEM;
+        return ptr;
+    }
+
+    struct thread_cache *tc = cache;
+    if (unlikely(!tc) && !(tc = create_thread_cache()))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    unsigned c = size_class(size);
+    struct class_cache *cc = &tc->classes[c];
+    if (likely(cc->count))
+        return cc->slots[--cc->count];
+
+    size_t bytes = class_size(c);
+    if (tc->bump[c] && tc->bump[c] + bytes <= tc->bump_end[c])
+    {
+        void *ptr = tc->bump[c];
+        tc->bump[c] += bytes;
+        return ptr;
+    }
+
+    void *ptr = refill(tc, c);
+    if (!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+void collate_safe_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    uint32_t info = slab_info[slab_index(ptr)];
+    if (unlikely(info & SLAB_LARGE))
+    {
+        if (((uintptr_t)ptr & (SLAB_SIZE - 1)) != 0)
+            abort();
+        free_large(ptr, info);
+        return;
+    }
+    if (unlikely(info == 0))
+        abort(); /* 不是分配出去的对象 */
+
+    struct thread_cache *tc = cache;
+    if (unlikely(!tc) && !(tc = create_thread_cache()))
+        return;
+
+    struct class_cache *cc = &tc->classes[info - 1];
+    if (unlikely(cc->count == CACHE_SLOTS))
+    {
+        flush_batch(tc, info - 1);
+        if (cc->count == CACHE_SLOTS)
+            return; /* 内存不足，放弃这个对象 */
+    }
+    cc->slots[cc->count++] = ptr;
+}
+
+void *collate_safe_calloc(size_t n, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = collate_safe_malloc(bytes);
+    if (ptr)
+    {
+        uint32_t pkru = collate_gate_save_open();
+        memset(ptr, 0, bytes);
+        collate_gate_restore(pkru);
+    }
+    return ptr;
+}
+
+size_t collate_safe_usable_size(const void *ptr)
+{
+    uint32_t info = slab_info[slab_index(ptr)];
+    if (info & SLAB_LARGE)
+        return (size_t)(info & ~SLAB_LARGE) << SLAB_SHIFT;
+    return info ? class_size(info - 1) : 0;
+}
+
+void *collate_safe_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return collate_safe_malloc(size);
+
+    /* 旧对象可能来自libc(分配点被标记的realloc)，按地址范围区分 */
+    int safe = collate_safe_heap_contains(ptr);
+    size_t old = safe ? collate_safe_usable_size(ptr) : malloc_usable_size(ptr);
+    if (safe && size <= old && size > old / 2)
+        return ptr;
+
+    void *fresh = collate_safe_malloc(size);
+    if (!fresh)
+        return NULL;
+
+    uint32_t pkru = collate_gate_save_open();
+    memcpy(fresh, ptr, old < size ? old : size);
+    collate_gate_restore(pkru);
+
+    if (safe)
+        collate_safe_free(ptr);
+    else
+        free(ptr);
+    return fresh;
+}
+
+void *collate_safe_aligned_alloc(size_t align, size_t size)
+{
+    /* 所有大小类都是16的倍数 */
+    if (align <= 16)
+        return collate_safe_malloc(size);
+    if (align > SLAB_SIZE || (align & (align - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* 2的幂的大小类从按64KiB对齐的slab开头等距切分，对象自然按自身大小对齐：
+       使用不小于max(size, align)的最小的2的幂的大小类，只有超过最大大小类时才占用span */
+    size_t n = size > align ? size : align;
+    if (n <= MAX_SMALL)
+        return collate_safe_malloc((size_t)1 << (64 - __builtin_clzl(n - 1)));
+
+    void *ptr = alloc_large(n);
+    if (!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+void *collate_safe_new(size_t size)
+{
+    void *ptr = collate_safe_malloc(size ? size : 1);
+    if (!ptr)
+    {
+        fputs("COLLATE: safe heap exhausted\n", stderr);
+        abort();
+    }
+    return ptr;
+}
+
+void collate_free(void *ptr)
+{
+    if (collate_safe_heap_contains(ptr))
+        collate_safe_free(ptr);
+    else
+        free(ptr);
+}
+
+void *collate_realloc(void *ptr, size_t size)
+{
+    if (collate_safe_heap_contains(ptr))
+        return collate_safe_realloc(ptr, size);
+    return realloc(ptr, size);
+}
+
+/* C程序中没有operator delete/delete[]，弱引用为空时退回free */
+extern void _ZdlPv(void *ptr) __attribute__((weak));
+extern void _ZdlPvm(void *ptr, size_t size) __attribute__((weak));
+extern void _ZdaPv(void *ptr) __attribute__((weak));
+extern void _ZdaPvm(void *ptr, size_t size) __attribute__((weak));
+
+void collate_delete(void *ptr)
+{
+    if (collate_safe_heap_contains(ptr))
+        collate_safe_free(ptr);
+    else if (_ZdlPv)
+        _ZdlPv(ptr);
+    else
+        free(ptr);
+}
+
+void collate_delete_sized(void *ptr, size_t size)
+{
+    if (collate_safe_heap_contains(ptr))
+        collate_safe_free(ptr);
+    else if (_ZdlPvm)
+        _ZdlPvm(ptr, size);
+    else
+        collate_delete(ptr);
+}
+
+/* 程序可能单独替换了operator delete[]，不在safe region中的指针必须交给数组版本 */
+void collate_delete_array(void *ptr)
+{
+    if (collate_safe_heap_contains(ptr))
+        collate_safe_free(ptr);
+    else if (_ZdaPv)
+        _ZdaPv(ptr);
+    else
+        free(ptr);
+}
+
+void collate_delete_array_sized(void *ptr, size_t size)
+{
+    if (collate_safe_heap_contains(ptr))
+        collate_safe_free(ptr);
+    else if (_ZdaPvm)
+        _ZdaPvm(ptr, size);
+    else
+        collate_delete_array(ptr);
+}
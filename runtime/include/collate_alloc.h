@@ -0,0 +1,44 @@
+#ifndef COLLATE_ALLOC_H
+#define COLLATE_ALLOC_H
+
+/*
+ * safe region中的堆分配器。
+ *
+ * 被标记的分配点(!collate.site)在插桩时改为调用collate_safe_*，分配的对象位于一块
+ * 用COLLATE的pkey映射的连续区域中；模块中所有的free/realloc/delete改为调用
+ * collate_free/collate_realloc等，它们按地址范围把指针交给safe region或libc。
+ * 这些符号的名字和类型与插桩端(collate/lib/transform/safe_heap.cpp)保持一致。
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *collate_safe_malloc(size_t size);
+void *collate_safe_calloc(size_t n, size_t size);
+void *collate_safe_realloc(void *ptr, size_t size);
+void *collate_safe_aligned_alloc(size_t align, size_t size);
+void collate_safe_free(void *ptr);
+
+/* operator new/new[]的替代：分配失败时终止程序而不是返回NULL */
+void *collate_safe_new(size_t size);
+
+/* ptr是否位于safe region的堆中 */
+int collate_safe_heap_contains(const void *ptr);
+size_t collate_safe_usable_size(const void *ptr);
+
+/* 模块中释放内存的调用的替代，ptr可以来自任意一个分配器 */
+void collate_free(void *ptr);
+void *collate_realloc(void *ptr, size_t size);
+void collate_delete(void *ptr);
+void collate_delete_sized(void *ptr, size_t size);
+void collate_delete_array(void *ptr);
+void collate_delete_array_sized(void *ptr, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef COLLATE_MANIFEST_H
+#define COLLATE_MANIFEST_H
+
+/*
+ * COLLATE写入插桩后二进制的受保护对象清单。
+ *
+ * 清单只在以-collate-manifest插桩时生成，放在名为collate_manifest的段中，由加载器随程序一起映射，
+ * 运行时直接按下面的结构读取，不需要解析(见runtime/statistics)。
+ * 每个被分析的模块贡献一个清单块，链接后依次排列在段中：
+ *     header | globals[num_globals] | stack_slots[num_stack_slots] | alloc_sites[num_alloc_sites]
+ * header.size是整个块的字节数，块按8字节对齐。地址字段由链接器/加载器重定位。
+ * 清单在所有变换之后生成，记录的是对象最终的位置。
+ * 只支持64位目标，分析端按同样的布局生成常量。
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COLLATE_MANIFEST_SECTION "collate_manifest"
+#define COLLATE_MANIFEST_MAGIC 0x544d4c43u /* "CLMT" */
+#define COLLATE_MANIFEST_VERSION 2u
+
+/* 栈对象在影子栈上，或者分配点改为使用safe region的分配器 */
+#define COLLATE_MANIFEST_PLACED 1u
+
+struct collate_manifest_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;            /* 包括header在内的整个块的字节数 */
+    uint32_t num_globals;
+    uint32_t num_stack_slots;
+    uint32_t num_alloc_sites;
+    uint32_t reserved[2];
+};
+
+/* 需要保护的全局变量，被移动到collate_safe_data段中的记录的是新的地址 */
+struct collate_global_entry
+{
+    void *addr;
+    uint64_t size;
+};
+
+/* 需要保护的栈上对象或堆对象的分配点。
+   site是同一个清单块中插桩时写入指令的!collate.site编号，栈对象和分配点共用编号；
+   size为0表示大小在编译时未知 */
+struct collate_site_entry
+{
+    uint32_t site;
+    uint32_t flags;           /* COLLATE_MANIFEST_PLACED */
+    uint64_t size;
+};
+
+#ifdef __cplusplus
+#define COLLATE_STATIC_ASSERT static_assert
+#else
+#define COLLATE_STATIC_ASSERT _Static_assert
+#endif
+
+COLLATE_STATIC_ASSERT(sizeof(struct collate_manifest_header) == 32, "manifest header layout");
+COLLATE_STATIC_ASSERT(sizeof(struct collate_global_entry) == 16, "manifest global entry layout");
+COLLATE_STATIC_ASSERT(sizeof(struct collate_site_entry) == 16, "manifest site entry layout");
+
+/* 链接器为名字是合法C标识符的段生成的边界符号；没有清单时为空 */
+extern const char __start_collate_manifest[] __attribute__((weak, visibility("hidden")));
+extern const char __stop_collate_manifest[] __attribute__((weak, visibility("hidden")));
+
+static inline const struct collate_global_entry *
+collate_manifest_globals(const struct collate_manifest_header *h)
+{
+    return (const struct collate_global_entry *)(h + 1);
+}
+
+static inline const struct collate_site_entry *
+collate_manifest_stack_slots(const struct collate_manifest_header *h)
+{
+    return (const struct collate_site_entry *)(collate_manifest_globals(h) + h->num_globals);
+}
+
+static inline const struct collate_site_entry *
+collate_manifest_alloc_sites(const struct collate_manifest_header *h)
+{
+    return collate_manifest_stack_slots(h) + h->num_stack_slots;
+}
+
+/* 遍历段中的清单块：cur为NULL时返回第一块，没有更多(或块损坏)时返回NULL */
+static inline const struct collate_manifest_header *
+collate_manifest_next(const struct collate_manifest_header *cur)
+{
+    const char *p = cur ? (const char *)cur + cur->size : __start_collate_manifest;
+    if (!p || p + sizeof(struct collate_manifest_header) > __stop_collate_manifest)
+        return NULL;
+
+    const struct collate_manifest_header *h = (const struct collate_manifest_header *)p;
+    if (h->magic != COLLATE_MANIFEST_MAGIC || h->version != COLLATE_MANIFEST_VERSION ||
+        h->size < sizeof(*h) || p + h->size > __stop_collate_manifest)
+        return NULL;
+    return h;
+}
+
+/* 所有清单块的汇总(runtime/statistics)。设置了环境变量COLLATE_STATS时程序退出前打印到标准错误 */
+struct collate_manifest_summary
+{
+    uint64_t num_blocks;
+    uint64_t num_globals;
+    uint64_t global_bytes;
+    uint64_t safe_data_globals;   /* 位于collate_safe_data段中(main开始时被保护)的全局变量 */
+    uint64_t num_stack_slots;
+    uint64_t shadow_stack_slots;  /* 在影子栈上的栈对象 */
+    uint64_t num_alloc_sites;
+    uint64_t safe_heap_sites;     /* 改为使用safe region分配器的分配点 */
+};
+
+void collate_manifest_summarize(struct collate_manifest_summary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef COLLATE_MPK_H
+#define COLLATE_MPK_H
+
+/*
+ * 基于Intel MPK的safe region访问控制。
+ *
+ * 运行时在启动时分配一个pkey，所有受保护的内存都用这个pkey映射；平时PKRU中该pkey的AD/WD位置1，
+ * 只有被授权的(trusted)指令前后会打开和关闭访问。
+ * 插桩端在trusted指令前后内联下面的序列，不调用函数也不经过信号：
+ *     open:  rdpkru; pkru &= collate_pkru_open_mask;  wrpkru
+ *     close: rdpkru; pkru |= collate_pkru_close_mask; wrpkru
+ * 只修改本pkey对应的两位，程序自己使用的其他pkey不受影响。
+ * collate_mpk_enabled为0(CPU或内核不支持pkey，或运行时尚未初始化)时序列直接跳过，
+ * 因为在不支持PKU的CPU上执行rdpkru/wrpkru会触发#UD。
+ * 这几个符号的名字和类型与插桩端(collate/lib/transform/mpk_gate.cpp)保持一致。
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int32_t collate_mpk_enabled;
+extern uint32_t collate_pkru_open_mask;   /* ~(AD|WD) of collate_mpk_pkey */
+extern uint32_t collate_pkru_close_mask;  /* AD|WD of collate_mpk_pkey */
+extern int collate_mpk_pkey;              /* 没有分配到pkey时为-1 */
+
+/* 分配pkey并关闭访问，程序启动时自动执行，其他运行时组件可以提前调用，重复调用无副作用 */
+void collate_mpk_init(void);
+
+/* 把[addr, addr+len)所在的页放入safe region，prot同mprotect。
+   没有启用MPK时只执行mprotect，返回值同mprotect */
+int collate_mpk_protect(void *addr, size_t len, int prot);
+
+/* 宽松模式：未被授权的指令访问safe region时不终止程序，而是在SIGSEGV handler中
+   打开访问并计数，直到下一条trusted指令的close再次关闭。只用于调试和兼容未插桩的库 */
+void init_handler(void);
+uint64_t collate_mpk_fault_count(void);
+
+/* 供运行时的其他部分和未插桩的C代码使用的外部函数版本 */
+void open_gate(void);
+void close_gate(void);
+
+#if defined(__x86_64__)
+static inline uint32_t collate_rdpkru(void)
+{
+    uint32_t eax, edx;
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xee" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+}
+
+static inline void collate_wrpkru(uint32_t pkru)
+{
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xef" : : "a"(pkru), "c"(0), "d"(0) : "memory");
+}
+
+static inline void collate_gate_open(void)
+{
+    if (collate_mpk_enabled)
+        collate_wrpkru(collate_rdpkru() & collate_pkru_open_mask);
+}
+
+static inline void collate_gate_close(void)
+{
+    if (collate_mpk_enabled)
+        collate_wrpkru(collate_rdpkru() | collate_pkru_close_mask);
+}
+
+/* 运行时内部访问safe region：打开访问并返回原来的PKRU，结束时原样恢复，
+   调用者处在打开状态时也不会被关闭 */
+static inline uint32_t collate_gate_save_open(void)
+{
+    if (!collate_mpk_enabled)
+        return 0;
+    uint32_t pkru = collate_rdpkru();
+    collate_wrpkru(pkru & collate_pkru_open_mask);
+    return pkru;
+}
+
+static inline void collate_gate_restore(uint32_t pkru)
+{
+    if (collate_mpk_enabled)
+        collate_wrpkru(pkru);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef COLLATE_SHADOW_STACK_H
+#define COLLATE_SHADOW_STACK_H
+
+/*
+ * 受保护的全局变量和栈对象。
+ *
+ * 全局变量被插桩端合并后放在collate_safe_data段中，每个模块的部分按页对齐、大小为整页，
+ * 整个段只包含受保护的数据，main开始时由collate_protect_safe_data用COLLATE的pkey保护。
+ *
+ * 栈对象放在每个线程的影子栈上。影子栈指针collate_shadow_sp是initial-exec模型的线程本地变量，
+ * 插桩的函数在入口把它向低地址移动一个帧，在每个出口和landingpad恢复；
+ * 线程第一次进入插桩的函数时指针为NULL，由collate_shadow_stack_attach从所有线程共享的保留区中分配影子栈。
+ * 这些符号的名字与插桩端(collate/lib/transform/safe_placement.cpp)保持一致。
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COLLATE_SAFE_DATA_SECTION "collate_safe_data"
+
+extern __thread char *collate_shadow_sp __attribute__((tls_model("initial-exec")));
+
+/* 为当前线程分配影子栈，设置并返回栈顶 */
+char *collate_shadow_stack_attach(void);
+
+/* 没有影子栈对象的函数在landingpad调用，恢复为进入函数时的指针saved */
+void collate_shadow_stack_unwind(char *saved);
+
+void collate_protect_safe_data(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
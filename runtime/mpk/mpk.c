@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "../include/collate_mpk.h"
+
+#include <cpuid.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#ifndef SYS_pkey_mprotect
+#define SYS_pkey_mprotect 329
+#endif
+#ifndef SYS_pkey_alloc
+#define SYS_pkey_alloc 330
+#endif
+#ifndef SEGV_PKUERR
+#define SEGV_PKUERR 4
+#endif
+
+#define PKEY_AD 0x1u
+#define PKEY_WD 0x2u
+#define XSTATE_PKRU_BIT 9
+
+/* 插桩的代码直接读取这些变量，初始化之前MPK处于关闭状态，序列被跳过 */
+int32_t collate_mpk_enabled = 0;
+uint32_t collate_pkru_open_mask = ~0u;
+uint32_t collate_pkru_close_mask = 0;
+int collate_mpk_pkey = -1;
+
+static uint32_t pkru_xsave_offset;   /* PKRU在XSAVE区域中的偏移，0表示未知 */
+static uint64_t fault_count;
+static struct sigaction previous_action;
+
+void collate_mpk_init(void)
+{
+    if (collate_mpk_pkey >= 0)
+        return;
+
+    long pkey = syscall(SYS_pkey_alloc, 0UL, 0UL);
+    if (pkey < 0)
+        return; /* CPU或内核不支持，退化为普通的mprotect */
+
+    uint32_t mask = (PKEY_AD | PKEY_WD) << (2 * pkey);
+    collate_mpk_pkey = (int)pkey;
+    collate_pkru_open_mask = ~mask;
+    collate_pkru_close_mask = mask;
+
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_count(0xd, XSTATE_PKRU_BIT, &eax, &ebx, &ecx, &edx))
+        pkru_xsave_offset = ebx;
+
+    /* pkey_alloc返回的pkey在PKRU中默认允许访问，先关闭再启用插桩的序列 */
+    collate_wrpkru(collate_rdpkru() | mask);
+    collate_mpk_enabled = 1;
+}
+
+/* 尽量早于程序自己的构造函数运行，使它们分配的受保护内存也能使用pkey。
+   头文件中已经声明了collate_mpk_init，GCC会忽略定义上的优先级，所以单独包一层 */
+__attribute__((constructor(101))) static void collate_mpk_ctor(void)
+{
+    collate_mpk_init();
+}
+
+int collate_mpk_protect(void *addr, size_t len, int prot)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+
+    if (collate_mpk_pkey < 0)
+        return mprotect((void *)start, end - start, prot);
+    return (int)syscall(SYS_pkey_mprotect, start, end - start, prot, (unsigned long)collate_mpk_pkey);
+}
+
+void open_gate(void)
+{
+    collate_gate_open();
+}
+
+void close_gate(void)
+{
+    collate_gate_close();
+}
+
+uint64_t collate_mpk_fault_count(void)
+{
+    return __atomic_load_n(&fault_count, __ATOMIC_RELAXED);
+}
+
+static void collate_mpk_sigsegv(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = (ucontext_t *)context;
+    char *xsave = (char *)uc->uc_mcontext.fpregs;
+
+    /* 其他原因的段错误交还给原来的处理方式，返回后重新执行指令再次触发 */
+    if (info->si_code != SEGV_PKUERR || !pkru_xsave_offset || !xsave)
+    {
+        sigaction(SIGSEGV, &previous_action, NULL);
+        return;
+    }
+
+    /* 内核在sigreturn时从信号栈帧的XSAVE区域恢复PKRU，
+       在那里打开访问，被中断的指令重新执行时就能通过 */
+    uint64_t *xstate_bv = (uint64_t *)(xsave + 512);
+    uint32_t *pkru = (uint32_t *)(xsave + pkru_xsave_offset);
+    if (!(*xstate_bv & (1ull << XSTATE_PKRU_BIT)))
+    {
+        *xstate_bv |= 1ull << XSTATE_PKRU_BIT;
+        *pkru = collate_rdpkru();
+    }
+    *pkru &= collate_pkru_open_mask;
+
+    __atomic_fetch_add(&fault_count, 1, __ATOMIC_RELAXED);
+    (void)sig;
+}
+
+void init_handler(void)
+{
+    collate_mpk_init();
+    if (!collate_mpk_enabled)
+        return;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = collate_mpk_sigsegv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_action);
+}
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "../include/collate_shadow_stack.h"
+#include "../include/collate_mpk.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * 所有线程的影子栈来自同一块保留的地址空间(默认8GiB，每个线程1MiB，
+ * 可用COLLATE_SHADOW_STACK_RESERVE和COLLATE_SHADOW_STACK_SIZE修改)。
+ * 保留时以MAP_NORESERVE映射并整体标记为COLLATE的pkey，物理页在第一次写入时才由内核分配，
+ * 因此线程创建时不需要mmap：第一次进入插桩的函数时从空闲列表或者保留区中取一个槽位，
+ * 只有槽位第一次被使用时用一次mprotect设置底部的保护页。
+ * 线程退出时归还槽位并释放已使用的物理页；保留区用完后退回为单个线程单独映射。
+ */
+
+#define DEFAULT_STACK_SIZE (1UL << 20)
+#define DEFAULT_RESERVE (8UL << 30)
+
+/* 插桩的函数在入口读取，initial-exec保证访问是一条fs相对的load */
+__thread char *collate_shadow_sp __attribute__((tls_model("initial-exec")));
+
+/* 链接器为collate_safe_data段生成的边界符号；没有受保护的全局变量时为空 */
+extern char __start_collate_safe_data[] __attribute__((weak, visibility("hidden")));
+extern char __stop_collate_safe_data[] __attribute__((weak, visibility("hidden")));
+
+struct free_slot
+{
+    struct free_slot *next;
+    size_t index;
+};
+
+static pthread_once_t reserve_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stack_key;
+static size_t page_size;
+static size_t slot_size;       /* 包括保护页 */
+static char *reserve_base;
+static size_t num_slots;
+static size_t next_slot;
+static unsigned char *guarded; /* 每个槽位的保护页是否已经设置 */
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_slot *free_slots;
+
+static size_t size_from_env(const char *name, size_t def)
+{
+    const char *env = getenv(name);
+    if (!env || !*env)
+        return def;
+
+    char *end;
+    unsigned long long size = strtoull(env, &end, 0);
+    switch (*end)
+    {
+    case 'g': case 'G': size <<= 30; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'k': case 'K': size <<= 10; break;
+    default: break;
+    }
+    return size ? (size_t)size : def;
+}
+
+static void detach(void *arg);
+
+static void reserve(void)
+{
+    collate_mpk_init();
+    pthread_key_create(&stack_key, detach);
+
+    page_size = sysconf(_SC_PAGESIZE);
+    size_t stack = size_from_env("COLLATE_SHADOW_STACK_SIZE", DEFAULT_STACK_SIZE);
+    slot_size = ((stack + page_size - 1) & ~(page_size - 1)) + page_size;
+
+    size_t total = size_from_env("COLLATE_SHADOW_STACK_RESERVE", DEFAULT_RESERVE);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    for (; total >= slot_size; total /= 2)
+    {
+        size_t slots = total / slot_size;
+        char *base = (char *)mmap(NULL, slots * slot_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED)
+            continue;
+
+        unsigned char *marks = (unsigned char *)mmap(NULL, slots, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (marks == MAP_FAILED || collate_mpk_protect(base, slots * slot_size, PROT_READ | PROT_WRITE) != 0)
+        {
+            munmap(base, slots * slot_size);
+            if (marks != MAP_FAILED)
+                munmap(marks, slots);
+            continue;
+        }
+
+        reserve_base = base;
+        guarded = marks;
+        num_slots = slots;
+        return;
+    }
+}
+
+/* 保留区用完时单独映射，槽位编号为num_slots表示不属于保留区 */
+static char *map_private_stack(void)
+{
+    char *base = (char *)mmap(NULL, slot_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED || collate_mpk_protect(base + page_size, slot_size - page_size, PROT_READ | PROT_WRITE) != 0)
+    {
+        fputs("COLLATE: cannot allocate the shadow stack\n", stderr);
+        abort();
+    }
+    return base;
+}
+
+char *collate_shadow_stack_attach(void)
+{
+    if (collate_shadow_sp)
+        return collate_shadow_sp;
+
+    pthread_once(&reserve_once, reserve);
+
+    size_t index = num_slots;
+    struct free_slot *reuse = NULL;
+    if (__atomic_load_n(&free_slots, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&free_lock);
+        reuse = free_slots;
+        if (reuse)
+            free_slots = reuse->next;
+        pthread_mutex_unlock(&free_lock);
+    }
+
+    if (reuse)
+    {
+        index = reuse->index;
+        free(reuse);
+    }
+    else if (num_slots)
+    {
+        index = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        if (index >= num_slots)
+            index = num_slots;
+    }
+
+    char *base;
+    if (index < num_slots)
+    {
+        base = reserve_base + index * slot_size;
+        /* 槽位底部的保护页，影子栈溢出时触发段错误 */
+        if (!guarded[index])
+        {
+            mprotect(base, page_size, PROT_NONE);
+            guarded[index] = 1;
+        }
+    }
+    else
+        base = map_private_stack();
+
+    pthread_setspecific(stack_key, base);
+    collate_shadow_sp = base + slot_size;
+    return collate_shadow_sp;
+}
+
+void collate_shadow_stack_unwind(char *saved)
+{
+    if (saved)
+    {
+        collate_shadow_sp = saved;
+        return;
+    }
+
+    /* 捕获异常的函数进入时线程还没有影子栈，之后由被调函数分配：回到栈顶 */
+    char *base = (char *)pthread_getspecific(stack_key);
+    collate_shadow_sp = base ? base + slot_size : NULL;
+}
+
+static void detach(void *arg)
+{
+    char *base = (char *)arg;
+
+    /* 线程退出后仍可能执行插桩的代码(其他TLS析构)，清空指针让它重新分配 */
+    collate_shadow_sp = NULL;
+
+    if (base < reserve_base || base >= reserve_base + num_slots * slot_size)
+    {
+        munmap(base, slot_size);
+        return;
+    }
+
+    /* 归还物理页，映射和pkey保持不变，槽位留给以后的线程 */
+    madvise(base + page_size, slot_size - page_size, MADV_DONTNEED);
+
+    struct free_slot *slot = (struct free_slot *)malloc(sizeof(struct free_slot));
+    if (!slot)
+        return;
+    slot->index = (base - reserve_base) / slot_size;
+    pthread_mutex_lock(&free_lock);
+    slot->next = free_slots;
+    free_slots = slot;
+    pthread_mutex_unlock(&free_lock);
+}
+
+void collate_protect_safe_data(void)
+{
+    static int protected_once;
+    char *start = __start_collate_safe_data, *stop = __stop_collate_safe_data;
+    if (protected_once || !start || start >= stop)
+        return;
+    protected_once = 1;
+
+    collate_mpk_init();
+    if (collate_mpk_protect(start, stop - start, PROT_READ | PROT_WRITE) != 0)
+        perror("COLLATE: cannot protect collate_safe_data");
+}
@@ -0,0 +1,68 @@
+#include "../include/collate_manifest.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 读取插桩时写入的受保护对象清单(-collate-manifest)，统计受保护的对象以及其中实际放入safe region的部分。
+ * 插桩后的模块在清单旁边引用collate_manifest_summarize，链接静态库时这个文件随清单一起被链接进来；
+ * 设置了环境变量COLLATE_STATS时在程序退出前把汇总打印到标准错误。
+ */
+
+/* 与runtime/shadow-stack中的定义一致；没有受保护的全局变量时为空 */
+extern char __start_collate_safe_data[] __attribute__((weak, visibility("hidden")));
+extern char __stop_collate_safe_data[] __attribute__((weak, visibility("hidden")));
+
+static int in_safe_data(const struct collate_global_entry *g)
+{
+    uintptr_t start = (uintptr_t)__start_collate_safe_data, stop = (uintptr_t)__stop_collate_safe_data;
+    uintptr_t addr = (uintptr_t)g->addr;
+    return start != stop && addr >= start && addr + g->size <= stop;
+}
+
+void collate_manifest_summarize(struct collate_manifest_summary *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    for (const struct collate_manifest_header *h = collate_manifest_next(NULL); h; h = collate_manifest_next(h))
+    {
+        summary->num_blocks++;
+
+        const struct collate_global_entry *globals = collate_manifest_globals(h);
+        for (uint32_t i = 0; i < h->num_globals; i++)
+        {
+            summary->global_bytes += globals[i].size;
+            summary->safe_data_globals += in_safe_data(&globals[i]);
+        }
+        summary->num_globals += h->num_globals;
+
+        const struct collate_site_entry *slots = collate_manifest_stack_slots(h);
+        for (uint32_t i = 0; i < h->num_stack_slots; i++)
+            summary->shadow_stack_slots += (slots[i].flags & COLLATE_MANIFEST_PLACED) != 0;
+        summary->num_stack_slots += h->num_stack_slots;
+
+        const struct collate_site_entry *sites = collate_manifest_alloc_sites(h);
+        for (uint32_t i = 0; i < h->num_alloc_sites; i++)
+            summary->safe_heap_sites += (sites[i].flags & COLLATE_MANIFEST_PLACED) != 0;
+        summary->num_alloc_sites += h->num_alloc_sites;
+    }
+}
+
+__attribute__((destructor)) static void collate_manifest_report(void)
+{
+    const char *env = getenv("COLLATE_STATS");
+    if (!env || !*env)
+        return;
+
+    struct collate_manifest_summary s;
+    collate_manifest_summarize(&s);
+    fprintf(stderr,
+            "COLLATE: %" PRIu64 " manifest blocks\n"
+            "COLLATE: globals: %" PRIu64 " (%" PRIu64 " bytes), %" PRIu64 " in collate_safe_data\n"
+            "COLLATE: stack slots: %" PRIu64 ", %" PRIu64 " on the shadow stack\n"
+            "COLLATE: alloc sites: %" PRIu64 ", %" PRIu64 " in the safe heap\n",
+            s.num_blocks, s.num_globals, s.global_bytes, s.safe_data_globals,
+            s.num_stack_slots, s.shadow_stack_slots, s.num_alloc_sites, s.safe_heap_sites);
+}
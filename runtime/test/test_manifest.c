@@ -0,0 +1,43 @@
+#include "../include/collate_manifest.h"
+#include "test_util.h"
+
+/* 清单的遍历和汇总：按插桩端的布局手写一个清单块，全局变量一个在collate_safe_data段中、一个不在 */
+
+static char safe_var[64] __attribute__((section("collate_safe_data"), aligned(64), used));
+static char plain_var[32];
+
+struct block
+{
+    struct collate_manifest_header header;
+    struct collate_global_entry globals[2];
+    struct collate_site_entry stack_slots[2];
+    struct collate_site_entry alloc_sites[3];
+};
+
+static const struct block manifest __attribute__((section(COLLATE_MANIFEST_SECTION), aligned(8), used)) = {
+    {COLLATE_MANIFEST_MAGIC, COLLATE_MANIFEST_VERSION, sizeof(struct block), 2, 2, 3, {0, 0}},
+    {{safe_var, sizeof(safe_var)}, {plain_var, sizeof(plain_var)}},
+    {{0, COLLATE_MANIFEST_PLACED, 16}, {1, 0, 8}},
+    {{2, COLLATE_MANIFEST_PLACED, 0}, {3, COLLATE_MANIFEST_PLACED, 24}, {4, 0, 0}},
+};
+
+int main(void)
+{
+    const struct collate_manifest_header *h = collate_manifest_next(NULL);
+    CHECK(h == &manifest.header);
+    CHECK(collate_manifest_stack_slots(h) == manifest.stack_slots);
+    CHECK(collate_manifest_alloc_sites(h) == manifest.alloc_sites);
+    CHECK(collate_manifest_next(h) == NULL);
+
+    struct collate_manifest_summary s;
+    collate_manifest_summarize(&s);
+    CHECK(s.num_blocks == 1);
+    CHECK(s.num_globals == 2);
+    CHECK(s.global_bytes == sizeof(safe_var) + sizeof(plain_var));
+    CHECK(s.safe_data_globals == 1);
+    CHECK(s.num_stack_slots == 2);
+    CHECK(s.shadow_stack_slots == 1);
+    CHECK(s.num_alloc_sites == 3);
+    CHECK(s.safe_heap_sites == 2);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "../include/collate_mpk.h"
+#include "test_util.h"
+
+#include <sys/mman.h>
+
+/* 开关的掩码、PKRU中的位和未授权访问触发的段错误 */
+
+static volatile char *page;
+
+static void touch_closed(void *arg)
+{
+    (void)arg;
+    collate_gate_close();
+    page[0] = 1;
+}
+
+static void touch_permissive(void *arg)
+{
+    (void)arg;
+    init_handler();
+    collate_gate_close();
+    page[1] = 2;
+    /* handler打开访问后重新执行写入，之后的访问不再触发 */
+    page[2] = page[1];
+    _exit(collate_mpk_fault_count() == 1 && page[2] == 2 ? 0 : 1);
+}
+
+int main(void)
+{
+    collate_mpk_init();
+    if (collate_mpk_pkey < 0)
+    {
+        puts("pkeys are not supported, skip");
+        return SKIP_CODE;
+    }
+
+    uint32_t bits = 3u << (2 * collate_mpk_pkey);
+    CHECK(collate_mpk_enabled);
+    CHECK(collate_pkru_close_mask == bits);
+    CHECK(collate_pkru_open_mask == ~bits);
+
+    /* 启动后默认关闭，开关只修改本pkey的两位 */
+    uint32_t other = collate_rdpkru() & ~bits;
+    CHECK((collate_rdpkru() & bits) == bits);
+    collate_gate_open();
+    CHECK((collate_rdpkru() & bits) == 0);
+    CHECK((collate_rdpkru() & ~bits) == other);
+    collate_gate_close();
+    CHECK((collate_rdpkru() & bits) == bits);
+    CHECK((collate_rdpkru() & ~bits) == other);
+
+    /* 已经打开时save_open/restore不会关闭 */
+    open_gate();
+    uint32_t saved = collate_gate_save_open();
+    collate_gate_restore(saved);
+    CHECK((collate_rdpkru() & bits) == 0);
+    close_gate();
+    saved = collate_gate_save_open();
+    CHECK((collate_rdpkru() & bits) == 0);
+    collate_gate_restore(saved);
+    CHECK((collate_rdpkru() & bits) == bits);
+
+    page = (volatile char *)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(page != MAP_FAILED);
+    CHECK(collate_mpk_protect((void *)page, 4096, PROT_READ | PROT_WRITE) == 0);
+
+    collate_gate_open();
+    page[0] = 42;
+    CHECK(page[0] == 42);
+    collate_gate_close();
+
+    CHECK(run_in_child(touch_closed, NULL) == SIGSEGV);
+    CHECK(run_in_child(touch_permissive, NULL) == 0);
+
+    puts("ok");
+    return 0;
+}
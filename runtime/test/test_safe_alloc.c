@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include "../include/collate_alloc.h"
+#include "../include/collate_mpk.h"
+#include "test_util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/* 大小类、对齐分配、calloc/realloc、delete[]和跨线程释放 */
+
+#define MAX_SMALL 32768
+#define THREADS 4
+
+static void check_size_classes(void)
+{
+    for (size_t size = 1; size <= MAX_SMALL; size += size < 512 ? 1 : 61)
+    {
+        char *p = (char *)collate_safe_malloc(size);
+        CHECK(p && collate_safe_heap_contains(p));
+        CHECK(((uintptr_t)p & 15) == 0);
+
+        /* 每次翻倍分成4档，浪费不超过四分之一 */
+        size_t usable = collate_safe_usable_size(p);
+        CHECK(usable >= size && usable <= size + size / 4 + 16);
+
+        collate_gate_open();
+        memset(p, 0x5a, usable);
+        collate_gate_close();
+
+        /* 释放后同一大小立即从线程本地的缓存中取回 */
+        collate_safe_free(p);
+        CHECK(collate_safe_malloc(size) == p);
+        collate_safe_free(p);
+    }
+
+    char *big = (char *)collate_safe_malloc(3 * MAX_SMALL + 1);
+    CHECK(big && collate_safe_heap_contains(big));
+    CHECK(collate_safe_usable_size(big) >= 3 * MAX_SMALL + 1);
+    collate_safe_free(big);
+}
+
+static void check_aligned(void)
+{
+    for (size_t align = 32; align <= 65536; align <<= 1)
+    {
+        for (size_t size = 0; size < 3 * align; size += align / 3 + 1)
+        {
+            void *p = collate_safe_aligned_alloc(align, size);
+            CHECK(p && ((uintptr_t)p & (align - 1)) == 0);
+            CHECK(collate_safe_usable_size(p) >= size);
+            collate_safe_free(p);
+        }
+    }
+    CHECK(collate_safe_aligned_alloc(48, 16) == NULL);
+
+    /* 64MiB的堆中每个对象占用一个slab时只能分配1024个 */
+    for (int i = 0; i < 100000; i++)
+        CHECK(collate_safe_aligned_alloc(32, 24) != NULL);
+}
+
+static void check_calloc_realloc(void)
+{
+    char *p = (char *)collate_safe_calloc(100, 10);
+    CHECK(p);
+    collate_gate_open();
+    for (int i = 0; i < 1000; i++)
+        CHECK(p[i] == 0);
+    for (int i = 0; i < 1000; i++)
+        p[i] = (char)i;
+    collate_gate_close();
+
+    char *q = (char *)collate_safe_realloc(p, 50000);
+    CHECK(q && q != p);
+    collate_gate_open();
+    for (int i = 0; i < 1000; i++)
+        CHECK(q[i] == (char)i);
+    collate_gate_close();
+    CHECK(collate_safe_realloc(q, 40000) == q);
+    collate_free(q);
+
+    /* 来自libc的指针交还给libc */
+    char *libc = (char *)malloc(64);
+    strcpy(libc, "libc");
+    CHECK(!collate_safe_heap_contains(libc));
+    libc = (char *)collate_realloc(libc, 128);
+    CHECK(strcmp(libc, "libc") == 0);
+    collate_free(libc);
+}
+
+/* 替换operator delete[]，检查不在safe region中的指针交给数组版本而不是operator delete */
+static int array_deletes;
+
+void _ZdaPv(void *ptr)
+{
+    array_deletes++;
+    free(ptr);
+}
+
+static void check_delete_array(void)
+{
+    void *p = collate_safe_new(256);
+    CHECK(collate_safe_heap_contains(p));
+    collate_delete_array(p);
+    CHECK(array_deletes == 0);
+
+    collate_delete_array(malloc(64));
+    CHECK(array_deletes == 1);
+    /* 没有定义sized版本时退回非sized的数组版本 */
+    collate_delete_array_sized(malloc(64), 64);
+    CHECK(array_deletes == 2);
+}
+
+static void *churn(void *arg)
+{
+    void **ptrs = (void **)arg;
+    /* 释放其他线程分配的对象，再分配新的 */
+    for (int round = 0; round < 200; round++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            collate_safe_free(ptrs[i]);
+            ptrs[i] = collate_safe_malloc(16 + (i * 37 + round) % 2000);
+            CHECK(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void check_threads(void)
+{
+    static void *ptrs[THREADS][256];
+    for (int t = 0; t < THREADS; t++)
+        for (int i = 0; i < 256; i++)
+            CHECK((ptrs[t][i] = collate_safe_malloc(64)) != NULL);
+
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; t++)
+        CHECK(pthread_create(&threads[t], NULL, churn, ptrs[t]) == 0);
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int t = 0; t < THREADS; t++)
+        for (int i = 0; i < 256; i++)
+            collate_safe_free(ptrs[t][i]);
+}
+
+int main(void)
+{
+    check_size_classes();
+    check_calloc_realloc();
+    check_delete_array();
+    check_threads();
+    check_aligned();
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include "../include/collate_mpk.h"
+#include "../include/collate_shadow_stack.h"
+#include "test_util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* 影子栈的分配、线程退出后槽位的复用、landingpad的恢复和保护页 */
+
+#define STACK_SIZE (1 << 20)
+#define THREADS 1000
+
+static void *attach_top(void *arg)
+{
+    char **top = (char **)arg;
+    *top = collate_shadow_stack_attach();
+    CHECK(collate_shadow_sp == *top);
+
+    collate_gate_open();
+    (*top)[-1] = 1;
+    collate_gate_close();
+    return NULL;
+}
+
+static pthread_barrier_t barrier;
+
+static void *attach_and_wait(void *arg)
+{
+    attach_top(arg);
+    pthread_barrier_wait(&barrier);
+    return NULL;
+}
+
+static void overflow(void *arg)
+{
+    (void)arg;
+    collate_gate_open();
+    collate_shadow_stack_attach()[-STACK_SIZE - 1] = 1;
+}
+
+static void touch_closed(void *arg)
+{
+    (void)arg;
+    collate_gate_close();
+    collate_shadow_stack_attach()[-1] = 1;
+}
+
+int main(void)
+{
+    CHECK(collate_shadow_sp == NULL);
+    char *top = collate_shadow_stack_attach();
+    CHECK(top && ((uintptr_t)top & 4095) == 0);
+    CHECK(collate_shadow_stack_attach() == top);
+
+    /* 插桩的函数移动指针，landingpad恢复：保存的值为NULL时回到栈顶 */
+    collate_shadow_sp = top - 64;
+    collate_shadow_stack_unwind(top - 32);
+    CHECK(collate_shadow_sp == top - 32);
+    collate_shadow_stack_unwind(NULL);
+    CHECK(collate_shadow_sp == top);
+
+    /* 线程退出后槽位回到空闲列表，下一个线程复用 */
+    pthread_t thread;
+    char *first, *second;
+    CHECK(pthread_create(&thread, NULL, attach_top, &first) == 0);
+    pthread_join(thread, NULL);
+    CHECK(pthread_create(&thread, NULL, attach_top, &second) == 0);
+    pthread_join(thread, NULL);
+    CHECK(first != top && second == first);
+
+    /* 同时存在的线程各自有不同的影子栈 */
+    static pthread_t threads[THREADS];
+    static char *tops[THREADS];
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    for (int i = 0; i < THREADS; i++)
+        CHECK(pthread_create(&threads[i], NULL, attach_and_wait, &tops[i]) == 0);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < THREADS; i++)
+    {
+        CHECK(tops[i] != top);
+        for (int j = 0; j < i; j++)
+            CHECK(tops[i] - tops[j] >= STACK_SIZE || tops[j] - tops[i] >= STACK_SIZE);
+    }
+
+    CHECK(run_in_child(overflow, NULL) == SIGSEGV);
+    if (collate_mpk_pkey >= 0)
+        CHECK(run_in_child(touch_closed, NULL) == SIGSEGV);
+
+    puts("ok");
+    return 0;
+}